@@ -151,7 +151,7 @@ v3 cross(const v3 a, const v3 b)
 {
     v3 res;
     res.x = a.y * b.z - a.z * b.y;
-    res.y = a.x * b.z - a.z * b.x;
+    res.y = a.z * b.x - a.x * b.z;
     res.z = a.x * b.y - a.y * b.x;
 
     return res;
@@ -1,25 +1,73 @@
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
+#include <linux/perf_event.h>
 #include "ray.h"
 
 #define internal static
 #define global static
 #define u32Max ((u32)-1)
+#define Pi32 3.14159265359f
 
 global u32 outputWidth = 1270, outputHeight = 720;
 global u32 raycastingDepth = 32;
 global u32 raysPerPixel = 8 * 4;
 global u32 coreCount = 4;
 global u32 tileDimension = 64; //if 0 then default.
+global bool numaAware = false; //bind workers per node, node-local framebuffer and scene.
+global bool directLightSampling = true; //next-event estimation with MIS at diffuse hits.
+global u32 timeBudgetMs = 0; //if 0 then raysPerPixel, else best image within the budget.
+global bool incrementalRerender = false; //apply a scene edit and re-render only the affected tiles.
+global bool profilingMode = false; //per-tile timeline to trace.json, perf counters per worker.
+global OutputFormat outputFormat = OutputFormat_BMP;
+global bool batchRender = false; //render every camera of batchViews in one run, each to its own file.
+global u32 orbitViewsCount = 0; //if not 0, the batch orbits this many views instead of batchViews.
+global bool outOfCore = false; //stream tiles to a tiled BigTIFF, memory independent of the output size.
+global bool costAwareScheduling = false; //cost pre-pass, expensive tiles first, oversized ones split.
+
+global BatchView batchViews[] =
+{
+    {v3(0, -10, 1), "front"},
+    {v3(10, 0, 1), "right"},
+    {v3(0, 10, 1), "back"},
+    {v3(-10, 0, 1), "left"},
+    {v3(-7, -7, 5), "above"},
+};
+
+#define maxNumaNodes 64
+#define subTilesPerSide 4
+#define deadlineMarginNanoseconds 5000000
+
+//anonymous pages, nothing is touched before the render threads touch it
+internal void*
+mapPages(const u64 size)
+{
+    void* res = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED)
+    {
+        std::cout <<"unable to map "<< size / (1024.0 * 1024.0) << " MB for the image!" << std::endl;
+        exit(1);
+    }
 
-internal u32
+    return res;
+}
+
+internal u64
 totalPixelSize(const Image& image)
 {
-    return image.width * image.height * sizeof(u32);
+    return (u64)image.width * image.height * sizeof(u32);
 }
 
 internal Image
@@ -29,16 +77,83 @@ allocateImage(const u32 width, const u32 height)
     image.width = width;
     image.height = height;
 
-    u32 outputPixelsSize = totalPixelSize(image);
-    image.pixels = (u32*)malloc(outputPixelsSize);
+    image.pixels = (u32*)mapPages(totalPixelSize(image));
+
+    return image;
+}
+
+internal void
+freeImage(Image* image)
+{
+    munmap(image->pixels, totalPixelSize(*image));
+    image->pixels = 0;
+}
+
+internal u64
+totalPixelSize(const TiledImage& image)
+{
+    return (u64)image.tileCountX * image.tileCountY
+        * image.tileWidth * image.tileHeight * sizeof(u32);
+}
+
+//dimensions and tile grid only, pixels and accumulators are null
+internal TiledImage
+tiledImageLayout(const u32 width, const u32 height,
+    const u32 tileWidth, const u32 tileHeight)
+{
+    TiledImage image;
+    image.width = width;
+    image.height = height;
+    image.tileWidth = tileWidth;
+    image.tileHeight = tileHeight;
+    image.tileCountX = (width + tileWidth - 1) / tileWidth;
+    image.tileCountY = (height + tileHeight - 1) / tileHeight;
+    image.pixels = 0;
+    image.accumulators = 0;
+
+    return image;
+}
+
+internal TiledImage
+allocateTiledImage(const u32 width, const u32 height,
+    const u32 tileWidth, const u32 tileHeight, const bool withAccumulators)
+{
+    TiledImage image = tiledImageLayout(width, height, tileWidth, tileHeight);
+
+    u64 pixelsSize = totalPixelSize(image);
+    image.pixels = (u32*)mapPages(pixelsSize);
+
+    if (withAccumulators)
+    {
+        image.accumulators = (PixelAccumulator*)mapPages(
+            pixelsSize / sizeof(u32) * sizeof(PixelAccumulator));
+    }
 
     return image;
 }
 
+internal void
+freeImage(TiledImage* image)
+{
+    if (image->accumulators)
+    {
+        munmap(image->accumulators,
+            totalPixelSize(*image) / sizeof(u32) * sizeof(PixelAccumulator));
+        image->accumulators = 0;
+    }
+    munmap(image->pixels, totalPixelSize(*image));
+    image->pixels = 0;
+}
+
 internal void
 writeImage(const Image& image, const char* filename)
 {
-    u32 outputPixelsSize = totalPixelSize(image);
+    u64 outputPixelsSize = totalPixelSize(image);
+    if (sizeof(BitmapHeader) + outputPixelsSize > u32Max)
+    {
+        std::cout <<"output is too large for "<< filename << ", use outOfCore!" << std::endl;
+        return;
+    }
     BitmapHeader header = {};
     header.fileType = 0x4D42;
     header.fileSize = sizeof(header) + outputPixelsSize;
@@ -138,6 +253,52 @@ rayIntersectsSphere(const v3& rayOrigin, const v3& rayDirection,
     return distance;
 }
 
+internal u64
+monotonicNanoseconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (u64)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+//cheap tick count for the profiling phases, only ratios of it are reported
+internal u64
+readTimestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+    return (u64)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+//high water mark of the resident set, 0 if /proc is not there
+internal u64
+peakResidentBytes()
+{
+    u64 res = 0;
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status)
+    {
+        char line[256];
+        unsigned long long kilobytes;
+        while (fgets(line, sizeof(line), status))
+        {
+            if (sscanf(line, "VmHWM: %llu kB", &kilobytes) == 1)
+            {
+                res = kilobytes * 1024;
+            }
+        }
+        fclose(status);
+    }
+
+    return res;
+}
+
 internal u64
 lockedAddAndReturnPrev(volatile u64* value, u64 added)
 {
@@ -145,6 +306,12 @@ lockedAddAndReturnPrev(volatile u64* value, u64 added)
     return res;
 }
 
+internal void
+lockedOr(u64* value, u64 bits)
+{
+    __sync_fetch_and_or(value, bits);
+}
+
 u32 xorshift(randomSeries* series)
 {
     u32 x = series->state;
@@ -200,225 +367,3012 @@ toSRGB(const v3& v)
 internal u32*
 getPixelPointer(const Image* image, const u32 x, const u32 y)
 {
-    u32* res = image->pixels + x + y * image->width;
+    u32* res = image->pixels + x + (u64)y * image->width;
 
     return res;
 }
 
-internal v3
-rayCast(WorkQueue* queue, World* world, v3 rayOrigin,
-     v3 rayDirection, randomSeries* series)
+//consecutive pixels in a row are contiguous only up to the tile edge
+internal u64
+getPixelIndex(const TiledImage* image, const u32 x, const u32 y)
 {
-    f32 minHitDistance = 0.0001f;
-    v3 result = v3(0, 0, 0);
-    v3 attenuation = v3(1, 1, 1);
-    u64 bouncesComputed = 0;
-
-    for (u32 bounceCount = 0;
-        bounceCount < raycastingDepth;
-        ++bounceCount)
-    {
-        f32 hitDistance = FLT_MAX;
-        v3 nextOrigin = {};
-        v3 nextNormal = {};
-        u32 hitMaterialIndex = 0;
-        ++bouncesComputed;
+    u32 tileX = x / image->tileWidth;
+    u32 tileY = y / image->tileHeight;
+    u64 tileStart = ((u64)tileX + (u64)tileY * image->tileCountX)
+        * image->tileWidth * image->tileHeight;
 
-        for (u32 planeIndex = 0;
-            planeIndex < world->planesCount;
-            ++planeIndex)
-        {
-            Plane plane = world->planes[planeIndex];
+    u64 res = tileStart + (x - tileX * image->tileWidth)
+        + (y - tileY * image->tileHeight) * image->tileWidth;
 
-            f32 thisDistance = rayIntersectsPlane(rayOrigin,
-                rayDirection, plane.normal, plane.distanceAlong);
-            if (thisDistance > minHitDistance && thisDistance < hitDistance)
-            {
-                hitDistance = thisDistance;
-                hitMaterialIndex = plane.matIndex;
+    return res;
+}
 
-                nextOrigin = rayOrigin + rayDirection * hitDistance;
-                nextNormal = plane.normal;
-            }
-        }
+internal u32*
+getPixelPointer(const TiledImage* image, const u32 x, const u32 y)
+{
+    u32* res = image->pixels + getPixelIndex(image, x, y);
 
-        for (u32 sphereIndex = 0;
-            sphereIndex < world->spheresCount;
-            ++sphereIndex)
-        {
-            Sphere sphere = world->spheres[sphereIndex];
+    return res;
+}
 
-            v3 rayOriginRelToSphereOrigin = rayOrigin - sphere.pos;
-            f32 thisDistance = rayIntersectsSphere(rayOriginRelToSphereOrigin,
-                rayDirection, sphere.pos, sphere.radius);
-            if (thisDistance > minHitDistance && thisDistance < hitDistance)
-            {
-                hitDistance = thisDistance;
-                hitMaterialIndex = sphere.matIndex;
+internal PixelAccumulator*
+getAccumulatorPointer(const TiledImage* image, const u32 x, const u32 y)
+{
+    PixelAccumulator* res = image->accumulators + getPixelIndex(image, x, y);
 
-                nextOrigin = rayOrigin + rayDirection * hitDistance;
-                nextNormal = normalize(nextOrigin - sphere.pos);
-            }
-        }
+    return res;
+}
 
-        if (hitMaterialIndex)
+//normalizes the first linesCount lines of every tile in one tile row by
+//the samples they actually got
+internal void
+resolveTileRowLines(TiledImage* image, const u32 tileY, const u32 linesCount)
+{
+    u64 tileArea = (u64)image->tileWidth * image->tileHeight;
+    u64 firstIndex = tileY * image->tileCountX * tileArea;
+    for (u32 tileX = 0; tileX < image->tileCountX; ++tileX)
+    {
+        u64 tileStart = firstIndex + tileX * tileArea;
+        u64 onePastLastIndex = tileStart + (u64)linesCount * image->tileWidth;
+        for (u64 index = tileStart; index < onePastLastIndex; ++index)
         {
-            Material matHit = world->materials[hitMaterialIndex];
-            result += hadamard(attenuation, matHit.emitColor);
-            f32 cosAttenuation =
-                dot(v3(0, 0, 0) - rayDirection, nextNormal);
-            if (cosAttenuation < 0.0f)
+            PixelAccumulator accumulator = image->accumulators[index];
+            v3 color = v3(0, 0, 0);
+            if (accumulator.samplesCount)
             {
-                cosAttenuation = 0.0f;
+                color = accumulator.radiance * (1.0f / (f32)accumulator.samplesCount);
             }
 
+            f32 alpha = 1.0f;
+            image->pixels[index] = packPixel(toSRGB(color), alpha * 255.0f);
+        }
+    }
+}
 
-            attenuation = hadamard(attenuation, matHit.refColor * cosAttenuation);
-
-            rayOrigin = nextOrigin;
+internal void
+resolveTileRow(TiledImage* image, const u32 tileY)
+{
+    resolveTileRowLines(image, tileY, image->tileHeight);
+}
 
-            v3 pureBounce = rayDirection - nextNormal
-                * 2.0f*dot(rayDirection, nextNormal);
+//converts the first linesCount lines of one row of tiles to the row-major
+//layout writeImage expects
+internal void
+swizzleTileRowLines(const TiledImage* source, Image* dest, const u32 tileY,
+    const u32 linesCount)
+{
+    u32 minY = tileY * source->tileHeight;
+    u32 onePastMaxY = minY + linesCount;
+    if (onePastMaxY > source->height)
+    {
+        onePastMaxY = source->height;
+    }
 
-            v3 randomBounce = normalize(nextNormal
-                            + v3(randomBiliteral(series), randomBiliteral(series), randomBiliteral(series)));
-            rayDirection = normalize(lerp(randomBounce, pureBounce, matHit.shininess));
-        }
-        else
+    for (u32 tileX = 0; tileX < source->tileCountX; ++tileX)
+    {
+        u32 minX = tileX * source->tileWidth;
+        u32 rowWidth = source->tileWidth;
+        if (minX + rowWidth > source->width)
         {
-            Material matHit = world->materials[hitMaterialIndex];
-            result += hadamard(attenuation, matHit.emitColor);
+            rowWidth = source->width - minX;
+        }
 
-            break;
+        for (u32 y = minY; y < onePastMaxY; ++y)
+        {
+            memcpy(getPixelPointer(dest, minX, y), getPixelPointer(source, minX, y),
+                rowWidth * sizeof(u32));
         }
     }
-    lockedAddAndReturnPrev(&queue->bouncesComputed, bouncesComputed);
+}
 
-    return result;
+internal void
+swizzleTileRow(const TiledImage* source, Image* dest, const u32 tileY)
+{
+    swizzleTileRowLines(source, dest, tileY, source->tileHeight);
 }
 
-internal bool
-renderTile(WorkQueue* queue)
+//writes every page of one row of tiles and of the output rows it becomes,
+//so the final resolve and swizzle do not pay for the first touch
+internal void
+prefaultTileRow(TiledImage* source, Image* dest, const u32 tileY)
 {
-    u64 workOrderIndex = lockedAddAndReturnPrev(&queue->nextWorkOrderIndex, 1);
-    if (workOrderIndex >= queue->workOrdersCount)
+    u64 tileArea = (u64)source->tileWidth * source->tileHeight;
+    u64 firstIndex = tileY * source->tileCountX * tileArea;
+    u64 rowArea = source->tileCountX * tileArea;
+    memset(source->pixels + firstIndex, 0, rowArea * sizeof(u32));
+    if (source->accumulators)
     {
-        return false;
+        PixelAccumulator* accumulators = source->accumulators + firstIndex;
+        for (u64 index = 0; index < rowArea; ++index)
+        {
+            accumulators[index].radiance = v3(0, 0, 0);
+            accumulators[index].samplesCount = 0;
+        }
     }
-    WorkOrder* order = queue->workOrders + workOrderIndex;
-    randomSeries series = order->series;
 
-    World* world = order->world;
-    Image image = order->image;
-    u32 xMin = order->minX;
-    u32 yMin = order->minY;
-    u32 onePastXCount = order->onePastXCount;
-    u32 onePastYCount = order->onePastYCount;
+    u32 minY = tileY * source->tileHeight;
+    u32 onePastMaxY = minY + source->tileHeight;
+    if (onePastMaxY > source->height)
+    {
+        onePastMaxY = source->height;
+    }
+    memset(getPixelPointer(dest, 0, minY), 0, (u64)(onePastMaxY - minY) * dest->width * sizeof(u32));
+}
 
-    v3 cameraPosition = v3(0, -10, 1);
-    v3 cameraZ = normalize(cameraPosition);
-    v3 cameraX = normalize(cross(v3(0, 0, 1), cameraZ));
-    v3 cameraY = normalize(cross(cameraZ, cameraX));
+global const u16 deflateLengthBase[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+global const u8 deflateLengthExtra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+global const u16 deflateDistanceBase[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+global const u8 deflateDistanceExtra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
 
-    f32 filmDist = 1.0f;
-    f32 filmWidth = 1.0f;
-    f32 filmHeight = 1.0f;
+global u32 crcTable[256];
+global u16 fixedLiteralCodes[288]; //bit-reversed, ready for putBits
+global u8 fixedLiteralLengths[288];
+global u8 deflateLengthCodes[259];
+global u8 deflateDistanceCodes[512]; //distance - 1 below 256, then (distance - 1) >> 7
 
-    if (image.width > image.height)
-    {
-        filmHeight = (f32)image.height / (f32)image.width
-            * filmWidth;
-    }
-    else if (image.height > image.width)
+internal u32
+reverseBits(const u32 code, const u32 length)
+{
+    u32 res = 0;
+    for (u32 bitIndex = 0; bitIndex < length; ++bitIndex)
     {
-        filmWidth = (f32)image.width / (f32)image.height
-            * filmHeight;
+        res |= ((code >> bitIndex) & 1) << (length - 1 - bitIndex);
     }
 
-    f32 halfFilmWidth = 0.5f * filmWidth;
-    f32 halfFilmHeight = 0.5f * filmHeight;
-    v3 filmCenter = (cameraPosition - cameraZ) * filmDist;
+    return res;
+}
 
-    f32 halfPixW = 0.5f / image.width;
-    f32 halfPixH = 0.5f / image.height;
+internal void
+initEncoderTables()
+{
+    for (u32 n = 0; n < 256; ++n)
+    {
+        u32 c = n;
+        for (u32 k = 0; k < 8; ++k)
+        {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        crcTable[n] = c;
+    }
 
-    for (u32 y = yMin; y< onePastYCount; ++y)
+    for (u32 symbol = 0; symbol < 288; ++symbol)
     {
-        f32 filmY = -1.0f + 2.0f*((f32)y / (f32)image.height);
-        u32* out = getPixelPointer(&image, xMin, y);
+        u32 code, length;
+        if (symbol < 144)
+        {
+            code = 0x30 + symbol;
+            length = 8;
+        }
+        else if (symbol < 256)
+        {
+            code = 0x190 + symbol - 144;
+            length = 9;
+        }
+        else if (symbol < 280)
+        {
+            code = symbol - 256;
+            length = 7;
+        }
+        else
+        {
+            code = 0xC0 + symbol - 280;
+            length = 8;
+        }
+        fixedLiteralCodes[symbol] = (u16)reverseBits(code, length);
+        fixedLiteralLengths[symbol] = (u8)length;
+    }
 
-        for (u32 x = xMin; x < onePastXCount; ++x)
+    for (u32 lengthCode = 0; lengthCode < 29; ++lengthCode)
+    {
+        for (u32 length = deflateLengthBase[lengthCode]; length < 259; ++length)
         {
-            f32 filmX = -1.0f + 2.0f*((f32)x / (f32)image.width);
+            deflateLengthCodes[length] = (u8)lengthCode;
+        }
+    }
 
-            v3 color = v3(0, 0, 0);
-            f32 contrib = 1.0f / (f32)raysPerPixel;
-            for (u32 rayIndex = 0; rayIndex < raysPerPixel; ++rayIndex)
+    for (u32 distanceCode = 0; distanceCode < 30; ++distanceCode)
+    {
+        for (u32 distance = deflateDistanceBase[distanceCode]; distance <= 32768; ++distance)
+        {
+            if (distance <= 256)
+            {
+                deflateDistanceCodes[distance - 1] = (u8)distanceCode;
+            }
+            else
             {
-                f32 offX = filmX + randomBiliteral(&series) * halfPixW;
-                f32 offY = filmY + randomBiliteral(&series) * halfPixH;
+                deflateDistanceCodes[256 + ((distance - 1) >> 7)] = (u8)distanceCode;
+            }
+        }
+    }
+}
 
-                v3 filmPoint = filmCenter
-                    + cameraX * offX * halfFilmWidth
-                    + cameraY * offY * halfFilmHeight;
+internal u32
+crc32(const u8* data, const u64 size)
+{
+    u32 crc = 0xFFFFFFFF;
+    for (u64 index = 0; index < size; ++index)
+    {
+        crc = crcTable[(crc ^ data[index]) & 0xFF] ^ (crc >> 8);
+    }
 
-                v3 rayOrigin = cameraPosition;
-                v3 rayDirection = normalize(filmPoint - cameraPosition);
+    return crc ^ 0xFFFFFFFF;
+}
 
-                color += rayCast(queue, world, rayOrigin, rayDirection, &series)
-                    * contrib;
-            }
+#define adlerBase 65521
 
-            color = toSRGB(color);
-            f32 alpha = 1.0f;
-            u32 bmpValue = packPixel(color, alpha * 255.0f);
-            *out++ = bmpValue;
+internal u32
+adler32(const u8* data, u64 size)
+{
+    u32 a = 1;
+    u32 b = 0;
+    while (size)
+    {
+        //largest run that cannot overflow b before the modulo
+        u32 runSize = size < 5552 ? (u32)size : 5552;
+        size -= runSize;
+        while (runSize--)
+        {
+            a += *data++;
+            b += a;
         }
+        a %= adlerBase;
+        b %= adlerBase;
     }
 
-    lockedAddAndReturnPrev(&queue->tilesRetiredCount, 1);
-    return true;
+    return (b << 16) | a;
 }
 
-internal void*
-workerThread(void* param)
+//adler32 of the concatenation, as zlib's adler32_combine
+internal u32
+adler32Combine(const u32 adler1, const u32 adler2, const u64 size2)
 {
-    WorkQueue* queue = (WorkQueue*)param;
-    while(renderTile(queue)) {};
-    return 0;
+    u32 remainder = (u32)(size2 % adlerBase);
+    u32 sum1 = adler1 & 0xFFFF;
+    u32 sum2 = (u32)(((u64)remainder * sum1) % adlerBase);
+    sum1 += (adler2 & 0xFFFF) + adlerBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + adlerBase - remainder;
+    if (sum1 >= adlerBase)
+    {
+        sum1 -= adlerBase;
+    }
+    if (sum1 >= adlerBase)
+    {
+        sum1 -= adlerBase;
+    }
+    if (sum2 >= (adlerBase << 1))
+    {
+        sum2 -= (adlerBase << 1);
+    }
+    if (sum2 >= adlerBase)
+    {
+        sum2 -= adlerBase;
+    }
+
+    return sum1 | (sum2 << 16);
 }
 
 internal void
-createThread(void* param)
+putBigEndian32(u8* at, const u32 value)
 {
-    pthread_t threadID;
-    pthread_create(&threadID, 0, workerThread, param);
+    at[0] = (u8)(value >> 24);
+    at[1] = (u8)(value >> 16);
+    at[2] = (u8)(value >> 8);
+    at[3] = (u8)value;
 }
 
-int main(const int argc, const char** argv)
+struct BitWriter
 {
-    timespec startOfTheWholeProgram;
-    clock_gettime(CLOCK_MONOTONIC, &startOfTheWholeProgram);
+    u8* at;
+    u64 bitBuffer;
+    u32 bitCount;
+};
 
-    Material materials[9] = {};
-    materials[0].emitColor = v3(0.1f, 0.1f, 0.9f);
-    materials[1].refColor = v3(0.1f, 0.9f, 0.1f);
-    materials[2].refColor = v3(0.7f, 0.5f, 0.3f);
-    materials[3].emitColor = v3(1.0f, 0.0f, 0.0f) * 8.0f;
-    materials[4].refColor = v3(0.2f, 0.8f, 0.2f);
-    materials[4].shininess = 0.7f;
-    materials[5].refColor = v3(0.4f, 0.8f, 0.9f);
-    materials[5].shininess = 0.85f;
-    materials[6].refColor = v3(1.0f, 1.0f, 1.0f);
-    materials[6].shininess = 1.0f;
-    materials[7].emitColor = v3(1.0f, 1.0f, 1.0f) * 16.0f;
-    materials[7].refColor = v3(0.0f, 0.0f, 0.0f);
-    materials[7].shininess = 1.0f;
-    materials[8].refColor = v3(0.0f, 0.8f, 0.3f);
-    materials[8].shininess = 0.99f;
-    
-    Plane planes[1] = {};
-    planes[0].normal = v3(0, 0, 1);
+//deflate packs bits starting from the least significant one
+internal void
+putBits(BitWriter* writer, const u32 bits, const u32 count)
+{
+    writer->bitBuffer |= (u64)bits << writer->bitCount;
+    writer->bitCount += count;
+    while (writer->bitCount >= 8)
+    {
+        *writer->at++ = (u8)writer->bitBuffer;
+        writer->bitBuffer >>= 8;
+        writer->bitCount -= 8;
+    }
+}
+
+internal void
+alignToByte(BitWriter* writer)
+{
+    if (writer->bitCount)
+    {
+        putBits(writer, 0, 8 - writer->bitCount);
+    }
+}
+
+internal void
+putFixedLiteral(BitWriter* writer, const u32 symbol)
+{
+    putBits(writer, fixedLiteralCodes[symbol], fixedLiteralLengths[symbol]);
+}
+
+internal void
+putFixedMatch(BitWriter* writer, const u32 length, const u32 distance)
+{
+    u32 lengthCode = deflateLengthCodes[length];
+    putFixedLiteral(writer, 257 + lengthCode);
+    putBits(writer, length - deflateLengthBase[lengthCode], deflateLengthExtra[lengthCode]);
+
+    u32 distanceCode = distance <= 256 ? deflateDistanceCodes[distance - 1]
+        : deflateDistanceCodes[256 + ((distance - 1) >> 7)];
+    putBits(writer, reverseBits(distanceCode, 5), 5);
+    putBits(writer, distance - deflateDistanceBase[distanceCode], deflateDistanceExtra[distanceCode]);
+}
+
+#define deflateWindowSize 32768
+#define deflateHashBits 15
+#define deflateMaxChain 16
+
+//one non-final fixed huffman block with greedy LZ77 matching, followed by
+//a sync flush, so independently compressed runs can be concatenated.
+//worst case output is size * 9 / 8 + 16 bytes
+internal void
+deflateRun(BitWriter* writer, const u8* data, const u32 size)
+{
+    s32* head = (s32*)malloc((1 << deflateHashBits) * sizeof(s32));
+    s32* prev = (s32*)malloc(deflateWindowSize * sizeof(s32));
+    memset(head, 0xFF, (1 << deflateHashBits) * sizeof(s32));
+
+    //BFINAL = 0, BTYPE = 01
+    putBits(writer, 0x2, 3);
+
+    u32 position = 0;
+    while (position < size)
+    {
+        u32 bestLength = 0;
+        u32 bestDistance = 0;
+
+        u32 hash = 0;
+        if (position + 3 <= size)
+        {
+            u32 key = data[position] | (data[position + 1] << 8) | (data[position + 2] << 16);
+            hash = (key * 2654435761u) >> (32 - deflateHashBits);
+
+            u32 maxLength = size - position < 258 ? size - position : 258;
+            s32 candidate = head[hash];
+            for (u32 chain = 0;
+                candidate >= 0 && position - candidate <= deflateWindowSize && chain < deflateMaxChain;
+                ++chain)
+            {
+                u32 length = 0;
+                while (length < maxLength && data[candidate + length] == data[position + length])
+                {
+                    ++length;
+                }
+                if (length > bestLength)
+                {
+                    bestLength = length;
+                    bestDistance = position - candidate;
+                    if (length == maxLength)
+                    {
+                        break;
+                    }
+                }
+                candidate = prev[candidate & (deflateWindowSize - 1)];
+            }
+        }
+
+        u32 advance = 1;
+        if (bestLength >= 3)
+        {
+            putFixedMatch(writer, bestLength, bestDistance);
+            advance = bestLength;
+        }
+        else
+        {
+            putFixedLiteral(writer, data[position]);
+        }
+
+        for (u32 step = 0; step < advance; ++step, ++position)
+        {
+            if (position + 3 <= size)
+            {
+                u32 key = data[position] | (data[position + 1] << 8) | (data[position + 2] << 16);
+                hash = (key * 2654435761u) >> (32 - deflateHashBits);
+                prev[position & (deflateWindowSize - 1)] = head[hash];
+                head[hash] = (s32)position;
+            }
+        }
+    }
+
+    //end of block, then an empty stored block to byte-align the stream
+    putFixedLiteral(writer, 256);
+    putBits(writer, 0, 3);
+    alignToByte(writer);
+    putBits(writer, 0x0000, 16);
+    putBits(writer, 0xFFFF, 16);
+
+    free(head);
+    free(prev);
+}
+
+internal u8
+paethPredictor(const s32 a, const s32 b, const s32 c)
+{
+    s32 p = a + b - c;
+    s32 pa = abs(p - a);
+    s32 pb = abs(p - b);
+    s32 pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+    {
+        return (u8)a;
+    }
+    if (pb <= pc)
+    {
+        return (u8)b;
+    }
+
+    return (u8)c;
+}
+
+//PNG rows go top-down, the image is bottom-up. The first row of a strip is
+//Sub filtered so it does not depend on the strip above, the rest are Paeth.
+internal void
+encodePngStrip(const Image* image, const u32 firstRow, const u32 onePastLastRow,
+    PngStrip* strip)
+{
+    u64 startTime = monotonicNanoseconds();
+
+    u32 rowSize = 1 + 3 * image->width;
+    u32 rawSize = (onePastLastRow - firstRow) * rowSize;
+    u8* raw = (u8*)malloc(rawSize + rowSize);
+    u8* rgbRows = (u8*)malloc(2 * 3 * image->width);
+
+    for (u32 row = firstRow; row < onePastLastRow; ++row)
+    {
+        u8* rgb = rgbRows + ((row - firstRow) & 1) * 3 * image->width;
+        u8* above = rgbRows + (((row - firstRow) & 1) ^ 1) * 3 * image->width;
+        u32* pixels = getPixelPointer(image, 0, image->height - 1 - row);
+        for (u32 x = 0; x < image->width; ++x)
+        {
+            rgb[3 * x + 0] = (u8)(pixels[x] >> 16);
+            rgb[3 * x + 1] = (u8)(pixels[x] >> 8);
+            rgb[3 * x + 2] = (u8)(pixels[x] >> 0);
+        }
+
+        u8* out = raw + (row - firstRow) * rowSize;
+        bool firstInStrip = row == firstRow;
+        out[0] = firstInStrip ? 1 : 4;
+        for (u32 byteIndex = 0; byteIndex < 3 * image->width; ++byteIndex)
+        {
+            s32 left = byteIndex >= 3 ? rgb[byteIndex - 3] : 0;
+            if (firstInStrip)
+            {
+                out[1 + byteIndex] = (u8)(rgb[byteIndex] - left);
+            }
+            else
+            {
+                s32 up = above[byteIndex];
+                s32 upLeft = byteIndex >= 3 ? above[byteIndex - 3] : 0;
+                out[1 + byteIndex] = (u8)(rgb[byteIndex] - paethPredictor(left, up, upLeft));
+            }
+        }
+    }
+
+    //IDAT chunk: length, type, data, crc
+    strip->data = (u8*)malloc(12 + (u64)rawSize * 9 / 8 + 16);
+    BitWriter writer = {};
+    writer.at = strip->data + 8;
+    deflateRun(&writer, raw, rawSize);
+
+    u32 dataSize = (u32)(writer.at - (strip->data + 8));
+    putBigEndian32(strip->data, dataSize);
+    memcpy(strip->data + 4, "IDAT", 4);
+    putBigEndian32(strip->data + 8 + dataSize, crc32(strip->data + 4, dataSize + 4));
+    strip->size = dataSize + 12;
+    strip->rawSize = rawSize;
+    strip->adler = adler32(raw, rawSize);
+
+    free(rgbRows);
+    free(raw);
+
+    strip->encodeNanoseconds = monotonicNanoseconds() - startTime;
+}
+
+//strip index in file order for a row of tiles, PNG starts at the top
+internal void
+encodePngTileRow(PngStream* stream, const u32 tileY)
+{
+    const TiledImage* source = stream->source;
+    u32 minY = tileY * source->tileHeight;
+    u32 onePastMaxY = minY + source->tileHeight;
+    if (onePastMaxY > source->height)
+    {
+        onePastMaxY = source->height;
+    }
+
+    u32 stripIndex = stream->stripsCount - 1 - tileY;
+    encodePngStrip(stream->image, source->height - onePastMaxY,
+        source->height - minY, stream->strips + stripIndex);
+}
+
+//called as tiles retire, the last tile of a row swizzles and encodes it
+internal void
+retirePngTile(PngStream* stream, const WorkOrder* order)
+{
+    u32 tileY = order->minY / stream->source->tileHeight;
+    u64 retired = lockedAddAndReturnPrev(stream->tilesRetired + tileY, 1) + 1;
+    if (retired == stream->source->tileCountX)
+    {
+        swizzleTileRow(stream->source, stream->image, tileY);
+        encodePngTileRow(stream, tileY);
+    }
+}
+
+//data needs room for 14 + width * height * 4 + 8 bytes, returns the size
+internal u64
+encodeQoi(const Image& image, u8* data)
+{
+    u8* at = data;
+
+    memcpy(at, "qoif", 4);
+    putBigEndian32(at + 4, image.width);
+    putBigEndian32(at + 8, image.height);
+    at[12] = 3; //RGB
+    at[13] = 0; //sRGB with linear alpha
+    at += 14;
+
+    u32 index[64] = {};
+    u32 previous = 0xFF000000;
+    u32 run = 0;
+
+    for (u32 row = 0; row < image.height; ++row)
+    {
+        u32* pixels = getPixelPointer(&image, 0, image.height - 1 - row);
+        for (u32 x = 0; x < image.width; ++x)
+        {
+            u32 pixel = pixels[x] | 0xFF000000;
+            if (pixel == previous)
+            {
+                ++run;
+                if (run == 62)
+                {
+                    *at++ = 0xC0 | (u8)(run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run)
+            {
+                *at++ = 0xC0 | (u8)(run - 1);
+                run = 0;
+            }
+
+            u8 r = (u8)(pixel >> 16);
+            u8 g = (u8)(pixel >> 8);
+            u8 b = (u8)pixel;
+            u32 hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+
+            if (index[hash] == pixel)
+            {
+                *at++ = (u8)hash;
+            }
+            else
+            {
+                index[hash] = pixel;
+
+                s8 dr = (s8)(r - (u8)(previous >> 16));
+                s8 dg = (s8)(g - (u8)(previous >> 8));
+                s8 db = (s8)(b - (u8)previous);
+                s8 drdg = (s8)(dr - dg);
+                s8 dbdg = (s8)(db - dg);
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    *at++ = 0x40 | (u8)((dr + 2) << 4) | (u8)((dg + 2) << 2) | (u8)(db + 2);
+                }
+                else if (dg >= -32 && dg <= 31 && drdg >= -8 && drdg <= 7
+                    && dbdg >= -8 && dbdg <= 7)
+                {
+                    *at++ = 0x80 | (u8)(dg + 32);
+                    *at++ = (u8)((drdg + 8) << 4) | (u8)(dbdg + 8);
+                }
+                else
+                {
+                    *at++ = 0xFE;
+                    *at++ = r;
+                    *at++ = g;
+                    *at++ = b;
+                }
+            }
+            previous = pixel;
+        }
+    }
+    if (run)
+    {
+        *at++ = 0xC0 | (u8)(run - 1);
+    }
+
+    u8 endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    memcpy(at, endMarker, sizeof(endMarker));
+    at += sizeof(endMarker);
+
+    return at - data;
+}
+
+internal u64
+writeQoi(const Image& image, const char* filename)
+{
+    u64 pixelsCount = (u64)image.width * image.height;
+    u8* data = (u8*)malloc(14 + pixelsCount * 4 + 8);
+    u64 size = encodeQoi(image, data);
+    FILE* outFile = fopen(filename, "wb");
+    if (outFile)
+    {
+        fwrite(data, size, 1, outFile);
+        fclose(outFile);
+    }
+    else
+    {
+        std::cout <<"unable to write output file "<< filename << "!" << std::endl;
+        size = 0;
+    }
+    free(data);
+
+    return size;
+}
+
+internal bool
+writeAt(const s32 fd, const void* data, u64 size, u64 offset)
+{
+    const u8* at = (const u8*)data;
+    while (size)
+    {
+        ssize_t written = pwrite(fd, at, size, offset);
+        if (written <= 0)
+        {
+            return false;
+        }
+        at += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+internal BigTiffEntry
+tiffEntry(const u16 tag, const u16 type, const u64 count, const u64 value)
+{
+    BigTiffEntry entry;
+    entry.tag = tag;
+    entry.type = type;
+    entry.count = count;
+    entry.value = value;
+    return entry;
+}
+
+//one TIFF tile per render tile, uncompressed RGB, so every tile offset is
+//known up front: header, IFD, offset and byte count arrays, then the tiles
+internal bool
+openTiffStream(TiffStream* stream, const char* filename)
+{
+    const TiledImage* layout = &stream->prototype.image;
+    u64 tilesCount = (u64)layout->tileCountX * layout->tileCountY;
+    stream->tileBytes = (u64)layout->tileWidth * layout->tileHeight * 3;
+
+    u16 shortType = 3;
+    u16 longType = 4;
+    u16 long8Type = 16;
+    u64 offsetsAt = 256;
+    u64 byteCountsAt = offsetsAt + tilesCount * sizeof(u64);
+    stream->dataOffset = (byteCountsAt + tilesCount * sizeof(u64) + 4095) & ~(u64)4095;
+    stream->fileSize = stream->dataOffset + tilesCount * stream->tileBytes;
+
+    //tags in ascending order
+    BigTiffEntry entries[11];
+    entries[0] = tiffEntry(256, longType, 1, layout->width);
+    entries[1] = tiffEntry(257, longType, 1, layout->height);
+    entries[2] = tiffEntry(258, shortType, 3, 8 | (8 << 16) | ((u64)8 << 32));
+    entries[3] = tiffEntry(259, shortType, 1, 1); //no compression
+    entries[4] = tiffEntry(262, shortType, 1, 2); //RGB
+    entries[5] = tiffEntry(277, shortType, 1, 3);
+    entries[6] = tiffEntry(284, shortType, 1, 1); //chunky
+    entries[7] = tiffEntry(322, longType, 1, layout->tileWidth);
+    entries[8] = tiffEntry(323, longType, 1, layout->tileHeight);
+    entries[9] = tiffEntry(324, long8Type, tilesCount,
+        tilesCount == 1 ? stream->dataOffset : offsetsAt);
+    entries[10] = tiffEntry(325, long8Type, tilesCount,
+        tilesCount == 1 ? stream->tileBytes : byteCountsAt);
+
+    u8 head[256] = {};
+    BigTiffHeader header;
+    header.byteOrder = 0x4949;
+    header.version = 43;
+    header.offsetSize = 8;
+    header.reserved = 0;
+    header.firstIfdOffset = sizeof(header);
+    u64 entriesCount = arrayCount(entries);
+    memcpy(head, &header, sizeof(header));
+    memcpy(head + sizeof(header), &entriesCount, sizeof(entriesCount));
+    memcpy(head + sizeof(header) + sizeof(entriesCount), entries, sizeof(entries));
+
+    stream->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stream->fd < 0)
+    {
+        std::cout <<"unable to write output file "<< filename << "!" << std::endl;
+        return false;
+    }
+    bool written = writeAt(stream->fd, head, sizeof(head), 0);
+
+    //the arrays go out in fixed chunks so memory does not grow with the tile count
+    u64 chunk[4096];
+    for (u64 firstTile = 0; firstTile < tilesCount && tilesCount > 1; firstTile += arrayCount(chunk))
+    {
+        u64 chunkCount = tilesCount - firstTile;
+        if (chunkCount > arrayCount(chunk))
+        {
+            chunkCount = arrayCount(chunk);
+        }
+
+        for (u64 index = 0; index < chunkCount; ++index)
+        {
+            chunk[index] = stream->dataOffset + (firstTile + index) * stream->tileBytes;
+        }
+        written = written && writeAt(stream->fd, chunk, chunkCount * sizeof(u64),
+            offsetsAt + firstTile * sizeof(u64));
+
+        for (u64 index = 0; index < chunkCount; ++index)
+        {
+            chunk[index] = stream->tileBytes;
+        }
+        written = written && writeAt(stream->fd, chunk, chunkCount * sizeof(u64),
+            byteCountsAt + firstTile * sizeof(u64));
+    }
+
+    written = written && ftruncate(stream->fd, stream->fileSize) == 0;
+    if (!written)
+    {
+        std::cout <<"unable to write output file "<< filename << "!" << std::endl;
+        close(stream->fd);
+        return false;
+    }
+    stream->writeFailed = false;
+    return true;
+}
+
+//flips the worker's finished tile to top down RGB and writes its rows to
+//the one or two TIFF tiles they land in, TIFF tiles start at the top of the
+//image and the film's at the bottom. Padding past the edges stays as
+//ftruncate left it, the buffer is free again on return
+internal void
+writeTiffTile(TiffStream* stream, ThreadContext* thread, const WorkOrder* order)
+{
+    const TiledImage* layout = &stream->prototype.image;
+    u32 rowWidth = order->onePastXCount - order->minX;
+    u64 rowBytes = (u64)layout->tileWidth * 3;
+    u64 tileX = order->minX / layout->tileWidth;
+    if (rowWidth < layout->tileWidth)
+    {
+        memset(thread->tileBytes, 0, stream->tileBytes);
+    }
+
+    //image rows, counted from the top
+    u32 onePastLastRow = layout->height - order->minY;
+    for (u32 row = layout->height - order->onePastYCount; row < onePastLastRow;)
+    {
+        u64 tiffTileY = row / layout->tileHeight;
+        u32 rowInTile = row % layout->tileHeight;
+        u32 rowsCount = layout->tileHeight - rowInTile;
+        if (rowsCount > onePastLastRow - row)
+        {
+            rowsCount = onePastLastRow - row;
+        }
+
+        for (u32 rowIndex = 0; rowIndex < rowsCount; ++rowIndex)
+        {
+            u32 filmY = layout->height - 1 - (row + rowIndex);
+            const u32* pixels = order->tilePixels + (filmY - order->minY) * layout->tileWidth;
+            u8* rgb = thread->tileBytes + rowIndex * rowBytes;
+            for (u32 x = 0; x < rowWidth; ++x)
+            {
+                rgb[3 * x + 0] = (u8)(pixels[x] >> 16);
+                rgb[3 * x + 1] = (u8)(pixels[x] >> 8);
+                rgb[3 * x + 2] = (u8)pixels[x];
+            }
+        }
+
+        u64 offset = stream->dataOffset
+            + (tiffTileY * layout->tileCountX + tileX) * stream->tileBytes
+            + rowInTile * rowBytes;
+        if (!writeAt(stream->fd, thread->tileBytes, rowsCount * rowBytes, offset))
+        {
+            stream->writeFailed = true;
+        }
+        row += rowsCount;
+    }
+}
+
+internal u64
+closeTiffStream(TiffStream* stream)
+{
+    close(stream->fd);
+    return stream->writeFailed ? 0 : stream->fileSize;
+}
+
+//looks at the origin from position, z up, anywhere but straight above or
+//below the origin
+internal Camera
+makeCamera(const v3& position, const u32 imageWidth, const u32 imageHeight)
+{
+    Camera camera;
+    camera.position = position;
+    camera.z = normalize(position);
+    camera.x = normalize(cross(v3(0, 0, 1), camera.z));
+    camera.y = normalize(cross(camera.z, camera.x));
+
+    f32 filmDist = 1.0f;
+    f32 filmWidth = 1.0f;
+    f32 filmHeight = 1.0f;
+
+    if (imageWidth > imageHeight)
+    {
+        filmHeight = (f32)imageHeight / (f32)imageWidth
+            * filmWidth;
+    }
+    else if (imageHeight > imageWidth)
+    {
+        filmWidth = (f32)imageWidth / (f32)imageHeight
+            * filmHeight;
+    }
+
+    camera.halfFilmWidth = 0.5f * filmWidth;
+    camera.halfFilmHeight = 0.5f * filmHeight;
+    camera.filmCenter = (position - camera.z) * filmDist;
+
+    return camera;
+}
+
+//filmX and filmY are in [-1, 1]
+internal v3
+getFilmPoint(const Camera* camera, const f32 filmX, const f32 filmY)
+{
+    return camera->filmCenter
+        + camera->x * filmX * camera->halfFilmWidth
+        + camera->y * filmY * camera->halfFilmHeight;
+}
+
+internal void
+markPrimitive(TileFootprint* footprint, const u32 primitiveIndex)
+{
+    footprint->primitives |= (u64)1 << (primitiveIndex % 64);
+}
+
+internal void
+markMaterial(TileFootprint* footprint, const u32 materialIndex)
+{
+    footprint->materials |= (u64)1 << (materialIndex % 64);
+}
+
+//cell units to a cell coordinate, clamped to the grid
+internal u32
+gridCellCoordinate(const f32 cell)
+{
+    f32 clamped = cell > 0.0f ? cell : 0.0f;
+    clamped = clamped < (f32)(footprintGridSide - 1) ? clamped : (f32)(footprintGridSide - 1);
+    return (u32)clamped;
+}
+
+internal void
+markCell(TileFootprint* footprint, const u32 x, const u32 y, const u32 z)
+{
+    u32 cellIndex = (z * footprintGridSide + y) * footprintGridSide + x;
+    footprint->cells[cellIndex / 64] |= (u64)1 << (cellIndex % 64);
+}
+
+//marks the cells along the first distance of the ray, FLT_MAX for a ray
+//that escaped. Samples are a cell apart and the far end is one, so every
+//point of the segment is in a marked cell or next to one: edits pad their
+//cells by one.
+internal void
+markSegment(TileState* tile, const v3& rayOrigin, const v3& rayDirection,
+    const f32 distance)
+{
+    const FootprintGrid* grid = tile->grid;
+    if (!grid)
+    {
+        return;
+    }
+
+    f32 origin[3] = {rayOrigin.x - grid->min.x, rayOrigin.y - grid->min.y,
+        rayOrigin.z - grid->min.z};
+    f32 direction[3] = {rayDirection.x, rayDirection.y, rayDirection.z};
+    f32 gridSize = grid->cellSize * footprintGridSide;
+
+    //clip to the grid's slabs
+    f32 tMin = 0.0f;
+    f32 tMax = distance;
+    for (u32 axis = 0; axis < 3; ++axis)
+    {
+        if (direction[axis] == 0.0f)
+        {
+            if (origin[axis] < 0.0f || origin[axis] > gridSize)
+            {
+                tMax = -1.0f;
+            }
+            continue;
+        }
+
+        f32 tNear = -origin[axis] / direction[axis];
+        f32 tFar = (gridSize - origin[axis]) / direction[axis];
+        if (tNear > tFar)
+        {
+            f32 swap = tNear;
+            tNear = tFar;
+            tFar = swap;
+        }
+        tMin = tNear > tMin ? tNear : tMin;
+        tMax = tFar < tMax ? tFar : tMax;
+    }
+
+    if (tMin > 0.0f || tMax < distance)
+    {
+        tile->footprint.outside = 1;
+    }
+    if (tMin > tMax)
+    {
+        return;
+    }
+
+    //in cell units a step of one cell is the unit direction itself
+    f32 inverseCellSize = 1.0f / grid->cellSize;
+    f32 x = (origin[0] + direction[0] * tMin) * inverseCellSize;
+    f32 y = (origin[1] + direction[1] * tMin) * inverseCellSize;
+    f32 z = (origin[2] + direction[2] * tMin) * inverseCellSize;
+    u32 samplesCount = (u32)((tMax - tMin) * inverseCellSize) + 1;
+    for (u32 sampleIndex = 0; sampleIndex < samplesCount; ++sampleIndex)
+    {
+        markCell(&tile->footprint, gridCellCoordinate(x), gridCellCoordinate(y),
+            gridCellCoordinate(z));
+        x += direction[0];
+        y += direction[1];
+        z += direction[2];
+    }
+    markCell(&tile->footprint,
+        gridCellCoordinate((origin[0] + direction[0] * tMax) * inverseCellSize),
+        gridCellCoordinate((origin[1] + direction[1] * tMax) * inverseCellSize),
+        gridCellCoordinate((origin[2] + direction[2] * tMax) * inverseCellSize));
+}
+
+//planes come first, then spheres
+internal u32
+spherePrimitiveIndex(const World* world, const u32 sphereIndex)
+{
+    return world->planesCount + sphereIndex;
+}
+
+internal bool
+isEmissive(const Material& material)
+{
+    return material.emitColor.x > 0.0f || material.emitColor.y > 0.0f
+        || material.emitColor.z > 0.0f;
+}
+
+//only perfectly rough, non-emitting surfaces get explicit light samples
+internal bool
+isDiffuse(const Material& material)
+{
+    return material.shininess == 0.0f && !isEmissive(material);
+}
+
+internal void
+buildEmitterList(World* world)
+{
+    world->emittersCount = 0;
+    world->emitters = (u32*)malloc(world->spheresCount * sizeof(u32));
+    for (u32 sphereIndex = 0; sphereIndex < world->spheresCount; ++sphereIndex)
+    {
+        if (isEmissive(world->materials[world->spheres[sphereIndex].matIndex]))
+        {
+            world->emitters[world->emittersCount++] = sphereIndex;
+        }
+    }
+}
+
+//any-hit query, stops at the first occluder closer than maxDistance
+internal bool
+isOccluded(const World* world, const v3& rayOrigin, const v3& rayDirection,
+    const f32 maxDistance, const u32 ignoredSphereIndex, TileFootprint* footprint)
+{
+    f32 minHitDistance = 0.0001f;
+
+    for (u32 planeIndex = 0;
+        planeIndex < world->planesCount;
+        ++planeIndex)
+    {
+        Plane plane = world->planes[planeIndex];
+
+        f32 thisDistance = rayIntersectsPlane(rayOrigin,
+            rayDirection, plane.normal, plane.distanceAlong);
+        if (thisDistance > minHitDistance && thisDistance < maxDistance)
+        {
+            markPrimitive(footprint, planeIndex);
+            return true;
+        }
+    }
+
+    for (u32 sphereIndex = 0;
+        sphereIndex < world->spheresCount;
+        ++sphereIndex)
+    {
+        if (sphereIndex == ignoredSphereIndex)
+        {
+            continue;
+        }
+        Sphere sphere = world->spheres[sphereIndex];
+
+        v3 rayOriginRelToSphereOrigin = rayOrigin - sphere.pos;
+        f32 thisDistance = rayIntersectsSphere(rayOriginRelToSphereOrigin,
+            rayDirection, sphere.pos, sphere.radius);
+        if (thisDistance > minHitDistance && thisDistance < maxDistance)
+        {
+            markPrimitive(footprint, spherePrimitiveIndex(world, sphereIndex));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//builds tangent and bitangent for a unit normal (Duff et al. 2017)
+internal void
+orthonormalBasis(const v3& normal, v3* tangent, v3* bitangent)
+{
+    f32 sign = copysignf(1.0f, normal.z);
+    f32 a = -1.0f / (sign + normal.z);
+    f32 b = normal.x * normal.y * a;
+    *tangent = v3(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    *bitangent = v3(b, sign + normal.y * normal.y * a, -normal.y);
+}
+
+internal v3
+sampleCosineHemisphere(const v3& normal, randomSeries* series)
+{
+    f32 u1 = randomUnilateral(series);
+    f32 u2 = randomUnilateral(series);
+    f32 r = sqrtf(u1);
+    f32 phi = 2.0f * Pi32 * u2;
+
+    v3 tangent, bitangent;
+    orthonormalBasis(normal, &tangent, &bitangent);
+
+    f32 z = sqrtf(1.0f - u1 > 0.0f ? 1.0f - u1 : 0.0f);
+    return normalize(tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi))
+        + normal * z);
+}
+
+//cosine of the cone the sphere subtends as seen from point, 1 if inside
+internal f32
+sphereConeCosine(const Sphere& sphere, const v3& point)
+{
+    v3 toCenter = sphere.pos - point;
+    f32 distanceSquared = dot(toCenter, toCenter);
+    f32 radiusSquared = sphere.radius * sphere.radius;
+    if (distanceSquared <= radiusSquared)
+    {
+        return 1.0f;
+    }
+
+    return sqrtf(1.0f - radiusSquared / distanceSquared);
+}
+
+//solid angle density of picking a direction towards this emitter
+internal f32
+lightPdf(const World* world, const Sphere& sphere, const v3& point)
+{
+    f32 cosThetaMax = sphereConeCosine(sphere, point);
+    if (cosThetaMax >= 1.0f)
+    {
+        return 0.0f;
+    }
+
+    f32 solidAngle = 2.0f * Pi32 * (1.0f - cosThetaMax);
+    return 1.0f / (solidAngle * (f32)world->emittersCount);
+}
+
+internal f32
+powerHeuristic(const f32 pdf, const f32 otherPdf)
+{
+    f32 pdfSquared = pdf * pdf;
+    f32 sum = pdfSquared + otherPdf * otherPdf;
+
+    return sum > 0.0f ? pdfSquared / sum : 0.0f;
+}
+
+//one light sample for a lambertian surface, MIS-weighted against BSDF sampling
+internal v3
+sampleDirectLight(const World* world, const v3& point, const v3& normal,
+    const v3& albedo, TileState* tile)
+{
+    v3 res = v3(0, 0, 0);
+    randomSeries* series = &tile->series;
+
+    u32 emitterSlot = (u32)(randomUnilateral(series) * (f32)world->emittersCount);
+    if (emitterSlot >= world->emittersCount)
+    {
+        emitterSlot = world->emittersCount - 1;
+    }
+    u32 sphereIndex = world->emitters[emitterSlot];
+    Sphere sphere = world->spheres[sphereIndex];
+    markPrimitive(&tile->footprint, spherePrimitiveIndex(world, sphereIndex));
+    markMaterial(&tile->footprint, sphere.matIndex);
+
+    f32 cosThetaMax = sphereConeCosine(sphere, point);
+    if (cosThetaMax >= 1.0f)
+    {
+        return res;
+    }
+
+    f32 cosTheta = 1.0f - randomUnilateral(series) * (1.0f - cosThetaMax);
+    f32 sinTheta = sqrtf(1.0f - cosTheta * cosTheta > 0.0f ? 1.0f - cosTheta * cosTheta : 0.0f);
+    f32 phi = 2.0f * Pi32 * randomUnilateral(series);
+
+    v3 axis = normalize(sphere.pos - point);
+    v3 tangent, bitangent;
+    orthonormalBasis(axis, &tangent, &bitangent);
+    v3 lightDirection = normalize(axis * cosTheta
+        + tangent * (sinTheta * cosf(phi)) + bitangent * (sinTheta * sinf(phi)));
+
+    f32 cosSurface = dot(lightDirection, normal);
+    if (cosSurface <= 0.0f)
+    {
+        return res;
+    }
+
+    f32 lightDistance = rayIntersectsSphere(point - sphere.pos,
+        lightDirection, sphere.pos, sphere.radius);
+    if (lightDistance == FLT_MAX)
+    {
+        return res;
+    }
+
+    //occluded or not, the segment is where an edit could change the answer
+    markSegment(tile, point, lightDirection, lightDistance);
+    ++tile->shadowRaysComputed;
+    if (isOccluded(world, point, lightDirection, lightDistance, sphereIndex,
+        &tile->footprint))
+    {
+        return res;
+    }
+
+    f32 pdfLight = lightPdf(world, sphere, point);
+    f32 pdfBsdf = cosSurface / Pi32;
+    f32 weight = powerHeuristic(pdfLight, pdfBsdf);
+
+    v3 emitColor = world->materials[sphere.matIndex].emitColor;
+    res = hadamard(emitColor, albedo) * (cosSurface / Pi32 * weight / pdfLight);
+
+    return res;
+}
+
+internal v3
+rayCast(const World* world, v3 rayOrigin,
+     v3 rayDirection, TileState* tile)
+{
+    f32 minHitDistance = 0.0001f;
+    v3 result = v3(0, 0, 0);
+    v3 attenuation = v3(1, 1, 1);
+    randomSeries* series = &tile->series;
+    TileFootprint* footprint = &tile->footprint;
+    WorkerProfile* profile = tile->profile;
+    bool sampleLights = directLightSampling && world->emittersCount;
+    bool lastBounceDiffuse = false;
+    f32 lastBsdfPdf = 0.0f;
+
+    for (u32 bounceCount = 0;
+        bounceCount < raycastingDepth;
+        ++bounceCount)
+    {
+        f32 hitDistance = FLT_MAX;
+        v3 nextOrigin = {};
+        v3 nextNormal = {};
+        u32 hitMaterialIndex = 0;
+        u32 hitSphereIndex = u32Max;
+        u32 hitPlaneIndex = u32Max;
+        ++tile->bouncesComputed;
+        u64 phaseStart = profile ? readTimestamp() : 0;
+
+        for (u32 planeIndex = 0;
+            planeIndex < world->planesCount;
+            ++planeIndex)
+        {
+            Plane plane = world->planes[planeIndex];
+
+            f32 thisDistance = rayIntersectsPlane(rayOrigin,
+                rayDirection, plane.normal, plane.distanceAlong);
+            if (thisDistance > minHitDistance && thisDistance < hitDistance)
+            {
+                hitDistance = thisDistance;
+                hitMaterialIndex = plane.matIndex;
+                hitSphereIndex = u32Max;
+                hitPlaneIndex = planeIndex;
+
+                nextOrigin = rayOrigin + rayDirection * hitDistance;
+                nextNormal = plane.normal;
+            }
+        }
+
+        for (u32 sphereIndex = 0;
+            sphereIndex < world->spheresCount;
+            ++sphereIndex)
+        {
+            Sphere sphere = world->spheres[sphereIndex];
+
+            v3 rayOriginRelToSphereOrigin = rayOrigin - sphere.pos;
+            f32 thisDistance = rayIntersectsSphere(rayOriginRelToSphereOrigin,
+                rayDirection, sphere.pos, sphere.radius);
+            if (thisDistance > minHitDistance && thisDistance < hitDistance)
+            {
+                hitDistance = thisDistance;
+                hitMaterialIndex = sphere.matIndex;
+                hitSphereIndex = sphereIndex;
+                hitPlaneIndex = u32Max;
+
+                nextOrigin = rayOrigin + rayDirection * hitDistance;
+                nextNormal = normalize(nextOrigin - sphere.pos);
+            }
+        }
+
+        if (profile)
+        {
+            u64 phaseEnd = readTimestamp();
+            profile->intersectionTicks += phaseEnd - phaseStart;
+            phaseStart = phaseEnd;
+        }
+
+        markSegment(tile, rayOrigin, rayDirection, hitDistance);
+        if (hitSphereIndex != u32Max)
+        {
+            markPrimitive(footprint, spherePrimitiveIndex(world, hitSphereIndex));
+        }
+        else if (hitPlaneIndex != u32Max)
+        {
+            markPrimitive(footprint, hitPlaneIndex);
+        }
+        markMaterial(footprint, hitMaterialIndex);
+
+        if (hitMaterialIndex)
+        {
+            Material matHit = world->materials[hitMaterialIndex];
+
+            //the light sample at the previous hit already covered part of this
+            v3 emitColor = matHit.emitColor;
+            if (sampleLights && lastBounceDiffuse && hitSphereIndex != u32Max
+                && isEmissive(matHit))
+            {
+                f32 pdfLight = lightPdf(world, world->spheres[hitSphereIndex], rayOrigin);
+                emitColor *= powerHeuristic(lastBsdfPdf, pdfLight);
+            }
+            result += hadamard(attenuation, emitColor);
+
+            if (isDiffuse(matHit))
+            {
+                if (dot(rayDirection, nextNormal) > 0.0f)
+                {
+                    nextNormal = v3(0, 0, 0) - nextNormal;
+                }
+
+                if (sampleLights)
+                {
+                    result += hadamard(attenuation, sampleDirectLight(world,
+                        nextOrigin, nextNormal, matHit.refColor, tile));
+                }
+
+                //cosine-weighted sampling cancels the lambertian cos/pi term
+                rayDirection = sampleCosineHemisphere(nextNormal, series);
+                lastBsdfPdf = dot(rayDirection, nextNormal) / Pi32;
+                lastBounceDiffuse = true;
+
+                attenuation = hadamard(attenuation, matHit.refColor);
+                rayOrigin = nextOrigin;
+            }
+            else
+            {
+                f32 cosAttenuation =
+                    dot(v3(0, 0, 0) - rayDirection, nextNormal);
+                if (cosAttenuation < 0.0f)
+                {
+                    cosAttenuation = 0.0f;
+                }
+
+                attenuation = hadamard(attenuation, matHit.refColor * cosAttenuation);
+
+                rayOrigin = nextOrigin;
+
+                v3 pureBounce = rayDirection - nextNormal
+                    * 2.0f*dot(rayDirection, nextNormal);
+
+                v3 randomBounce = normalize(nextNormal
+                                + v3(randomBiliteral(series), randomBiliteral(series), randomBiliteral(series)));
+                rayDirection = normalize(lerp(randomBounce, pureBounce, matHit.shininess));
+                lastBounceDiffuse = false;
+            }
+
+            if (profile)
+            {
+                profile->shadingTicks += readTimestamp() - phaseStart;
+            }
+        }
+        else
+        {
+            Material matHit = world->materials[hitMaterialIndex];
+            result += hadamard(attenuation, matHit.emitColor);
+
+            if (profile)
+            {
+                profile->shadingTicks += readTimestamp() - phaseStart;
+            }
+            break;
+        }
+    }
+
+    return result;
+}
+
+internal bool
+readSysfsLine(const char* path, char* line, const u32 lineSize)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        return false;
+    }
+
+    bool res = fgets(line, lineSize, file) != 0;
+    fclose(file);
+
+    return res;
+}
+
+//parses sysfs list format, e.g. "0-3,8,10-11"
+internal u32
+parseIndexList(const char* text, u32* indices, const u32 maxIndices)
+{
+    u32 count = 0;
+    const char* at = text;
+
+    while (count < maxIndices)
+    {
+        char* end;
+        u32 first = (u32)strtoul(at, &end, 10);
+        if (end == at)
+        {
+            break;
+        }
+        at = end;
+
+        u32 last = first;
+        if (*at == '-')
+        {
+            ++at;
+            last = (u32)strtoul(at, &end, 10);
+            at = end;
+        }
+
+        for (u32 index = first; index <= last && count < maxIndices; ++index)
+        {
+            indices[count++] = index;
+        }
+
+        if (*at != ',')
+        {
+            break;
+        }
+        ++at;
+    }
+
+    return count;
+}
+
+internal void
+detectNumaNodes(WorkQueue* queue)
+{
+    cpu_set_t allowedCpus;
+    CPU_ZERO(&allowedCpus);
+    sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus);
+
+    char line[4096];
+    u32 nodeIds[maxNumaNodes];
+    u32 nodeIdsCount = 0;
+    if (readSysfsLine("/sys/devices/system/node/online", line, sizeof(line)))
+    {
+        nodeIdsCount = parseIndexList(line, nodeIds, maxNumaNodes);
+    }
+
+    queue->nodes = (NumaNode*)calloc(nodeIdsCount + 1, sizeof(NumaNode));
+    queue->nodesCount = 0;
+
+    u32* cpus = (u32*)malloc(CPU_SETSIZE * sizeof(u32));
+    for (u32 idIndex = 0; idIndex < nodeIdsCount; ++idIndex)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+            nodeIds[idIndex]);
+        if (!readSysfsLine(path, line, sizeof(line)))
+        {
+            continue;
+        }
+
+        u32 cpusCount = parseIndexList(line, cpus, CPU_SETSIZE);
+        NumaNode* node = queue->nodes + queue->nodesCount;
+        node->cpus = (u32*)malloc(cpusCount * sizeof(u32));
+        for (u32 cpuIndex = 0; cpuIndex < cpusCount; ++cpuIndex)
+        {
+            if (CPU_ISSET(cpus[cpuIndex], &allowedCpus))
+            {
+                node->cpus[node->cpuCount++] = cpus[cpuIndex];
+            }
+        }
+
+        if (node->cpuCount)
+        {
+            ++queue->nodesCount;
+        }
+        else
+        {
+            free(node->cpus);
+            node->cpus = 0;
+        }
+    }
+    free(cpus);
+
+    if (queue->nodesCount == 0)
+    {
+        std::cout<<"NUMA topology not found in sysfs, using a single node."<<std::endl;
+        queue->nodesCount = 1;
+        queue->nodes[0].cpuCount = get_nprocs();
+    }
+}
+
+//cpu lists and scene replicas, then the nodes themselves
+internal void
+freeNumaNodes(WorkQueue* queue)
+{
+    for (u32 nodeIndex = 0; nodeIndex < queue->nodesCount; ++nodeIndex)
+    {
+        free(queue->nodes[nodeIndex].cpus);
+        free(queue->nodes[nodeIndex].world);
+    }
+    free(queue->nodes);
+    queue->nodes = 0;
+    queue->nodesCount = 0;
+}
+
+//start of the node's contiguous share of [0, count), proportional to its
+//cpu count, the start of node nodesCount is count
+internal u32
+nodeShareStart(const WorkQueue* queue, const u32 nodeIndex, const u32 count)
+{
+    u32 totalCpus = 0;
+    u32 cpusBefore = 0;
+    for (u32 index = 0; index < queue->nodesCount; ++index)
+    {
+        totalCpus += queue->nodes[index].cpuCount;
+        if (index < nodeIndex)
+        {
+            cpusBefore += queue->nodes[index].cpuCount;
+        }
+    }
+
+    return (u32)((u64)count * cpusBefore / totalCpus);
+}
+
+//node gets a contiguous range of tiles proportional to its cpu count
+internal void
+assignNodeWorkOrders(WorkQueue* queue)
+{
+    for (u32 nodeIndex = 0; nodeIndex < queue->nodesCount; ++nodeIndex)
+    {
+        NumaNode* node = queue->nodes + nodeIndex;
+        node->firstWorkOrder = nodeShareStart(queue, nodeIndex, queue->workOrdersCount);
+        node->onePastLastWorkOrder = nodeShareStart(queue, nodeIndex + 1, queue->workOrdersCount);
+        node->nextWorkOrderIndex = node->firstWorkOrder;
+    }
+}
+
+internal void
+bindThreadToNode(const NumaNode* node)
+{
+    if (!node->cpus)
+    {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (u32 cpuIndex = 0; cpuIndex < node->cpuCount; ++cpuIndex)
+    {
+        CPU_SET(node->cpus[cpuIndex], &cpus);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+//single allocation, so the whole scene lands on the calling thread's node
+internal World*
+replicateWorld(const World* source)
+{
+    u32 materialsSize = source->materialsCount * sizeof(Material);
+    u32 planesSize = source->planesCount * sizeof(Plane);
+    u32 spheresSize = source->spheresCount * sizeof(Sphere);
+    u32 emittersSize = source->spheresCount * sizeof(u32);
+    u8* memory = (u8*)malloc(sizeof(World) + materialsSize + planesSize
+        + spheresSize + emittersSize);
+
+    World* world = (World*)memory;
+    *world = *source;
+    world->materials = (Material*)(memory + sizeof(World));
+    world->planes = (Plane*)((u8*)world->materials + materialsSize);
+    world->spheres = (Sphere*)((u8*)world->planes + planesSize);
+    world->emitters = (u32*)((u8*)world->spheres + spheresSize);
+    memcpy(world->materials, source->materials, materialsSize);
+    memcpy(world->planes, source->planes, planesSize);
+    memcpy(world->spheres, source->spheres, spheresSize);
+    memcpy(world->emitters, source->emitters, source->emittersCount * sizeof(u32));
+
+    return world;
+}
+
+//copies in place, so the replica's pages stay on its node
+internal void
+updateReplica(World* replica, const World* source)
+{
+    replica->emittersCount = source->emittersCount;
+    memcpy(replica->materials, source->materials, source->materialsCount * sizeof(Material));
+    memcpy(replica->planes, source->planes, source->planesCount * sizeof(Plane));
+    memcpy(replica->spheres, source->spheres, source->spheresCount * sizeof(Sphere));
+    memcpy(replica->emitters, source->emitters, source->emittersCount * sizeof(u32));
+}
+
+internal void
+firstTouchWorkOrder(const WorkOrder* order)
+{
+    u32 rowWidth = order->onePastXCount - order->minX;
+    for (u32 y = order->minY; y < order->onePastYCount; ++y)
+    {
+        u32* out = getPixelPointer(&order->image, order->minX, y);
+        memset(out, 0, rowWidth * sizeof(u32));
+
+        if (order->image.accumulators)
+        {
+            PixelAccumulator* accumulator =
+                getAccumulatorPointer(&order->image, order->minX, y);
+            for (u32 x = 0; x < rowWidth; ++x)
+            {
+                accumulator[x].radiance = v3(0, 0, 0);
+                accumulator[x].samplesCount = 0;
+            }
+        }
+    }
+}
+
+//binds the thread, places the node's framebuffer tiles and scene replica
+//in node-local memory and waits for all the other workers to do the same
+internal void
+prepareWorker(ThreadContext* thread)
+{
+    WorkQueue* queue = thread->queue;
+    if (!queue->numaAware)
+    {
+        return;
+    }
+
+    NumaNode* node = queue->nodes + thread->nodeIndex;
+    bindThreadToNode(node);
+
+    if (thread->nodeWorkerIndex == 0
+        && node->firstWorkOrder < node->onePastLastWorkOrder)
+    {
+        const WorkOrder* firstOrder = queue->tiffStream ? &queue->tiffStream->prototype
+            : queue->workOrders + node->firstWorkOrder;
+        node->world = replicateWorld(firstOrder->world);
+    }
+
+    //out-of-core frames have no framebuffer to place
+    for (u32 workOrderIndex = node->firstWorkOrder + thread->nodeWorkerIndex;
+        workOrderIndex < node->onePastLastWorkOrder && queue->workOrders;
+        workOrderIndex += node->cpuCount)
+    {
+        firstTouchWorkOrder(queue->workOrders + workOrderIndex);
+    }
+
+    pthread_barrier_wait(&queue->firstTouchBarrier);
+    thread->world = node->world;
+}
+
+//opens cycles, instructions and cache misses as one group for the calling
+//thread, leaves the fds at -1 if the kernel or the machine does not allow it
+internal void
+openCounters(WorkerProfile* profile)
+{
+    u64 configs[3] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+
+    s32 groupFd = -1;
+    for (u32 counterIndex = 0; counterIndex < arrayCount(configs); ++counterIndex)
+    {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[counterIndex];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        s32 fd = (s32)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+        if (fd < 0)
+        {
+            for (u32 openedIndex = 0; openedIndex < counterIndex; ++openedIndex)
+            {
+                close(profile->counterFds[openedIndex]);
+                profile->counterFds[openedIndex] = -1;
+            }
+            profile->counterFds[counterIndex] = -1;
+            return;
+        }
+
+        profile->counterFds[counterIndex] = fd;
+        if (groupFd < 0)
+        {
+            groupFd = fd;
+        }
+    }
+}
+
+internal void
+closeCounters(WorkerProfile* profile)
+{
+    for (u32 counterIndex = 0; counterIndex < arrayCount(profile->counterFds); ++counterIndex)
+    {
+        if (profile->counterFds[counterIndex] >= 0)
+        {
+            close(profile->counterFds[counterIndex]);
+            profile->counterFds[counterIndex] = -1;
+        }
+    }
+}
+
+internal void
+readCounters(const WorkerProfile* profile, u64* counters)
+{
+    u64 values[4] = {};
+    if (profile->counterFds[0] < 0
+        || read(profile->counterFds[0], values, sizeof(values)) < (ssize_t)sizeof(values))
+    {
+        values[1] = values[2] = values[3] = 0;
+    }
+
+    //values[0] is the number of counters in the group
+    counters[0] = values[1];
+    counters[1] = values[2];
+    counters[2] = values[3];
+}
+
+internal void
+recordTileEvent(WorkerProfile* profile, const TileEvent& event)
+{
+    if (profile->eventsCount == profile->eventsCapacity)
+    {
+        profile->eventsCapacity = profile->eventsCapacity ? 2 * profile->eventsCapacity : 256;
+        profile->events = (TileEvent*)realloc(profile->events,
+            profile->eventsCapacity * sizeof(TileEvent));
+    }
+
+    profile->events[profile->eventsCount++] = event;
+}
+
+internal void
+printProfile(const ThreadContext* threads, const u32 threadsCount)
+{
+    u64 firstStart = (u64)-1;
+    u64 lastEnd = 0;
+    u64 busy = 0;
+    u64 bounces = 0;
+    u64 counters[3] = {};
+    u64 intersectionTicks = 0;
+    u64 shadingTicks = 0;
+
+    for (u32 threadIndex = 0; threadIndex < threadsCount; ++threadIndex)
+    {
+        const WorkerProfile* profile = &threads[threadIndex].profile;
+        u64 threadBusy = 0;
+        for (u32 eventIndex = 0; eventIndex < profile->eventsCount; ++eventIndex)
+        {
+            const TileEvent* event = profile->events + eventIndex;
+            firstStart = event->start < firstStart ? event->start : firstStart;
+            lastEnd = event->end > lastEnd ? event->end : lastEnd;
+            threadBusy += event->end - event->start;
+            bounces += event->bounces;
+            for (u32 counterIndex = 0; counterIndex < arrayCount(counters); ++counterIndex)
+            {
+                counters[counterIndex] += event->counters[counterIndex];
+            }
+        }
+        busy += threadBusy;
+        intersectionTicks += profile->intersectionTicks;
+        shadingTicks += profile->shadingTicks;
+
+        std::cout<<"Worker "<<threadIndex<<": "<<profile->eventsCount<<" tiles, "
+            <<threadBusy / 1000000.0<<"ms busy."<<std::endl;
+    }
+
+    if (lastEnd <= firstStart)
+    {
+        return;
+    }
+
+    u64 span = (lastEnd - firstStart) * threadsCount;
+    std::cout<<"Workers idle "<<100.0 * (span - busy) / span<<"% of the render span."<<std::endl;
+    if (intersectionTicks + shadingTicks)
+    {
+        std::cout<<"Intersection "<<100.0 * intersectionTicks / (intersectionTicks + shadingTicks)
+            <<"%, shading "<<100.0 * shadingTicks / (intersectionTicks + shadingTicks)
+            <<"% of rayCast time."<<std::endl;
+    }
+    if (counters[0])
+    {
+        std::cout<<"Instructions per cycle: "<<(f64)counters[1] / counters[0]
+            <<", cache misses per bounce: "<<(f64)counters[2] / bounces<<std::endl;
+    }
+    std::cout<<std::endl;
+}
+
+//Chrome trace-event JSON, open in chrome://tracing or ui.perfetto.dev
+internal void
+writeTrace(const ThreadContext* threads, const u32 threadsCount,
+    const u64 timeOrigin, const char* filename)
+{
+    FILE* outFile = fopen(filename, "w");
+    if (!outFile)
+    {
+        std::cout <<"unable to write trace file "<< filename << "!" << std::endl;
+        return;
+    }
+
+    fprintf(outFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (u32 threadIndex = 0; threadIndex < threadsCount; ++threadIndex)
+    {
+        const ThreadContext* thread = threads + threadIndex;
+        fprintf(outFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+            "\"args\":{\"name\":\"worker %u (node %u)\"}}",
+            first ? "" : ",\n", threadIndex, threadIndex, thread->nodeIndex);
+        first = false;
+
+        for (u32 eventIndex = 0; eventIndex < thread->profile.eventsCount; ++eventIndex)
+        {
+            const TileEvent* event = thread->profile.events + eventIndex;
+            fprintf(outFile, ",\n{\"name\":\"tile %u,%u\",\"cat\":\"tile\",\"ph\":\"X\","
+                "\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"pass\":%u,\"bounces\":%llu,\"cycles\":%llu,"
+                "\"instructions\":%llu,\"cacheMisses\":%llu}}",
+                event->minX, event->minY, threadIndex,
+                (event->start - timeOrigin) / 1000.0, (event->end - event->start) / 1000.0,
+                event->passIndex, (unsigned long long)event->bounces,
+                (unsigned long long)event->counters[0], (unsigned long long)event->counters[1],
+                (unsigned long long)event->counters[2]);
+        }
+    }
+    fprintf(outFile, "\n]}\n");
+    fclose(outFile);
+}
+
+//out-of-core orders are made when taken on the same grid and seeds as the
+//in-core ones, tile rows handed out from the top down like the TIFF's
+internal WorkOrder*
+makeStreamedWorkOrder(ThreadContext* thread, const u64 tileIndex)
+{
+    const WorkOrder* prototype = &thread->queue->tiffStream->prototype;
+    const TiledImage* layout = &prototype->image;
+    u32 tileX = (u32)(tileIndex % layout->tileCountX);
+    u32 tileY = layout->tileCountY - 1 - (u32)(tileIndex / layout->tileCountX);
+
+    WorkOrder* order = &thread->streamedOrder;
+    *order = *prototype;
+    order->minX = tileX * layout->tileWidth;
+    order->onePastXCount = order->minX + layout->tileWidth;
+    if (order->onePastXCount > layout->width)
+    {
+        order->onePastXCount = layout->width;
+    }
+    order->minY = tileY * layout->tileHeight;
+    order->onePastYCount = order->minY + layout->tileHeight;
+    if (order->onePastYCount > layout->height)
+    {
+        order->onePastYCount = layout->height;
+    }
+    order->series.state = tileY * tileX;
+    order->tilePixels = thread->tilePixels;
+
+    return order;
+}
+
+//own node first, then steal from the others
+internal WorkOrder*
+takeWorkOrder(ThreadContext* thread)
+{
+    WorkQueue* queue = thread->queue;
+    for (u32 nodeOffset = 0; nodeOffset < queue->nodesCount; ++nodeOffset)
+    {
+        NumaNode* node = queue->nodes + (thread->nodeIndex + nodeOffset) % queue->nodesCount;
+        if (node->nextWorkOrderIndex >= node->onePastLastWorkOrder)
+        {
+            continue;
+        }
+
+        u64 workOrderIndex = lockedAddAndReturnPrev(&node->nextWorkOrderIndex, 1);
+        if (workOrderIndex < node->onePastLastWorkOrder)
+        {
+            if (queue->tiffStream)
+            {
+                return makeStreamedWorkOrder(thread, workOrderIndex);
+            }
+            return queue->workOrders + workOrderIndex;
+        }
+    }
+
+    return 0;
+}
+
+//false once every node's orders have been taken
+internal bool
+workOrdersLeft(const WorkQueue* queue)
+{
+    for (u32 nodeIndex = 0; nodeIndex < queue->nodesCount; ++nodeIndex)
+    {
+        const NumaNode* node = queue->nodes + nodeIndex;
+        if (node->nextWorkOrderIndex < node->onePastLastWorkOrder)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+internal void finishView(View* view);
+
+//renders [xMin, onePastXCount) x [yMin, onePastYCount) of the order's tile,
+//the whole tile or one of its sub-tiles, and publishes the counts
+internal void
+renderRect(ThreadContext* thread, WorkOrder* order, randomSeries* series,
+    const u32 xMin, const u32 yMin, const u32 onePastXCount, const u32 onePastYCount)
+{
+    WorkQueue* queue = thread->queue;
+    u64 rectStart = monotonicNanoseconds();
+    WorkerProfile* profile = profilingMode ? &thread->profile : 0;
+    TileEvent event = {};
+    if (profile)
+    {
+        event.start = monotonicNanoseconds();
+        readCounters(profile, event.counters);
+    }
+
+    TileState tile = {};
+    tile.series = *series;
+    tile.profile = profile;
+    tile.grid = queue->footprintGrid;
+
+    World* world = thread->world ? thread->world : order->world;
+    TiledImage image = order->image;
+
+    Camera camera = *order->camera;
+
+    f32 halfPixW = 0.5f / image.width;
+    f32 halfPixH = 0.5f / image.height;
+
+    u32 samplesCount = queue->passSamplesCount;
+    u64 deadline = queue->deadline;
+    u64 tileSamplesComputed = 0;
+    bool cancelled = false;
+
+    for (u32 y = yMin; y< onePastYCount && !cancelled; ++y)
+    {
+        f32 filmY = -1.0f + 2.0f*((f32)y / (f32)image.height);
+        u32* out = order->tilePixels
+            ? order->tilePixels + (y - order->minY) * image.tileWidth + (xMin - order->minX)
+            : getPixelPointer(&image, xMin, y);
+        PixelAccumulator* accumulator = 0;
+        if (image.accumulators)
+        {
+            accumulator = getAccumulatorPointer(&image, xMin, y);
+        }
+
+        for (u32 x = xMin; x < onePastXCount; ++x)
+        {
+            //cancellation point, pixels left untouched keep their earlier samples
+            if (deadline && monotonicNanoseconds() >= deadline)
+            {
+                cancelled = true;
+                break;
+            }
+
+            f32 filmX = -1.0f + 2.0f*((f32)x / (f32)image.width);
+
+            v3 color = v3(0, 0, 0);
+            f32 contrib = accumulator ? 1.0f : 1.0f / (f32)samplesCount;
+            for (u32 rayIndex = 0; rayIndex < samplesCount; ++rayIndex)
+            {
+                f32 offX = filmX + randomBiliteral(&tile.series) * halfPixW;
+                f32 offY = filmY + randomBiliteral(&tile.series) * halfPixH;
+
+                v3 filmPoint = getFilmPoint(&camera, offX, offY);
+
+                v3 rayOrigin = camera.position;
+                v3 rayDirection = normalize(filmPoint - camera.position);
+
+                color += rayCast(world, rayOrigin, rayDirection, &tile) * contrib;
+            }
+
+            tileSamplesComputed += samplesCount;
+
+            if (accumulator)
+            {
+                accumulator->radiance += color;
+                accumulator->samplesCount += samplesCount;
+                ++accumulator;
+            }
+            else
+            {
+                color = toSRGB(color);
+                f32 alpha = 1.0f;
+                u32 bmpValue = packPixel(color, alpha * 255.0f);
+                *out++ = bmpValue;
+            }
+        }
+    }
+
+    //next pass continues the sequence instead of repeating it
+    *series = tile.series;
+    lockedOr(&order->footprint.primitives, tile.footprint.primitives);
+    lockedOr(&order->footprint.materials, tile.footprint.materials);
+    if (tile.grid)
+    {
+        for (u32 wordIndex = 0; wordIndex < arrayCount(tile.footprint.cells); ++wordIndex)
+        {
+            lockedOr(order->footprint.cells + wordIndex, tile.footprint.cells[wordIndex]);
+        }
+        lockedOr(&order->footprint.outside, tile.footprint.outside);
+    }
+
+    if (profile)
+    {
+        u64 countersBefore[3];
+        memcpy(countersBefore, event.counters, sizeof(countersBefore));
+        readCounters(profile, event.counters);
+        for (u32 counterIndex = 0; counterIndex < arrayCount(event.counters); ++counterIndex)
+        {
+            event.counters[counterIndex] -= countersBefore[counterIndex];
+        }
+
+        event.end = monotonicNanoseconds();
+        event.bounces = tile.bouncesComputed;
+        event.minX = xMin;
+        event.minY = yMin;
+        event.passIndex = queue->passIndex;
+        recordTileEvent(profile, event);
+    }
+
+    lockedAddAndReturnPrev(&queue->bouncesComputed, tile.bouncesComputed);
+    lockedAddAndReturnPrev(&queue->shadowRaysComputed, tile.shadowRaysComputed);
+    lockedAddAndReturnPrev(&queue->samplesComputed, tileSamplesComputed);
+
+    u64 rectEnd = monotonicNanoseconds();
+    thread->busyNanoseconds += rectEnd - rectStart;
+    thread->lastRectEnd = rectEnd;
+}
+
+//the order's last rect is done: count the tile and hand it to the output
+internal void
+retireWorkOrder(ThreadContext* thread, WorkOrder* order)
+{
+    WorkQueue* queue = thread->queue;
+    if (queue->tiffStream)
+    {
+        writeTiffTile(queue->tiffStream, thread, order);
+    }
+    lockedAddAndReturnPrev(&queue->tilesRetiredCount, 1);
+    if (queue->pngStream)
+    {
+        retirePngTile(queue->pngStream, order);
+    }
+    if (queue->views)
+    {
+        View* view = queue->views + order->viewIndex;
+        if (lockedAddAndReturnPrev(&view->tilesRetired, 1) + 1 == view->tilesCount)
+        {
+            //with the queue drained the other workers would only wait at the
+            //pass barrier, so the view is left to finishDrainedViews
+            if (workOrdersLeft(queue))
+            {
+                finishView(view);
+            }
+            else
+            {
+                view->drained = true;
+            }
+        }
+    }
+}
+
+//claims the order's next sub-tile, false once all are claimed. Sub-tiles
+//split the tile evenly, write into the same tile block with stride
+//tileWidth and get their own seeds
+internal bool
+renderSubTile(ThreadContext* thread, WorkOrder* order)
+{
+    u32 subTilesCount = subTilesPerSide * subTilesPerSide;
+    u64 subTileIndex = lockedAddAndReturnPrev(&order->nextSubTile, 1);
+    if (subTileIndex >= subTilesCount)
+    {
+        return false;
+    }
+
+    u32 subX = (u32)subTileIndex % subTilesPerSide;
+    u32 subY = (u32)subTileIndex / subTilesPerSide;
+    u32 width = order->onePastXCount - order->minX;
+    u32 height = order->onePastYCount - order->minY;
+
+    randomSeries series;
+    series.state = (order->series.state + 1) * 2654435761u + (u32)subTileIndex * 40503u;
+    if (!series.state)
+    {
+        series.state = 1;
+    }
+
+    renderRect(thread, order, &series,
+        order->minX + width * subX / subTilesPerSide,
+        order->minY + height * subY / subTilesPerSide,
+        order->minX + width * (subX + 1) / subTilesPerSide,
+        order->minY + height * (subY + 1) / subTilesPerSide);
+
+    if (lockedAddAndReturnPrev(&order->subTilesRetired, 1) + 1 == subTilesCount)
+    {
+        retireWorkOrder(thread, order);
+    }
+    return true;
+}
+
+//the queue ran dry: help with the sub-tiles of oversized tiles in flight
+internal bool
+stealSubTile(ThreadContext* thread)
+{
+    WorkQueue* queue = thread->queue;
+    u64 splitOrdersCount = queue->splitOrdersCount;
+    for (u64 splitIndex = 0; splitIndex < splitOrdersCount; ++splitIndex)
+    {
+        //slot is filled after the count, if we miss it its owner renders it
+        WorkOrder* order = queue->splitOrders[splitIndex];
+        if (order && renderSubTile(thread, order))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+internal bool
+renderTile(ThreadContext* thread)
+{
+    WorkQueue* queue = thread->queue;
+    WorkOrder* order = takeWorkOrder(thread);
+    while (order && order->upToDate)
+    {
+        order = takeWorkOrder(thread);
+    }
+    if (!order)
+    {
+        return queue->splitOrders && stealSubTile(thread);
+    }
+
+    //oversized tiles go sub-tile by sub-tile so idle workers can join in
+    if (queue->splitOrders && order->estimatedCost > queue->splitCostThreshold)
+    {
+        u64 splitIndex = lockedAddAndReturnPrev(&queue->splitOrdersCount, 1);
+        queue->splitOrders[splitIndex] = order;
+        while (renderSubTile(thread, order)) {};
+        return true;
+    }
+
+    renderRect(thread, order, &order->series,
+        order->minX, order->minY, order->onePastXCount, order->onePastYCount);
+    retireWorkOrder(thread, order);
+    return true;
+}
+
+internal void
+beginPass(WorkQueue* queue, const u32 samplesCount)
+{
+    queue->passSamplesCount = samplesCount;
+    queue->tilesRetiredCount = 0;
+    //stale slots would let a stealer pick up an order that is up to date now
+    for (u64 splitIndex = 0; splitIndex < queue->splitOrdersCount; ++splitIndex)
+    {
+        queue->splitOrders[splitIndex]->nextSubTile = 0;
+        queue->splitOrders[splitIndex]->subTilesRetired = 0;
+        queue->splitOrders[splitIndex] = 0;
+    }
+    queue->splitOrdersCount = 0;
+    for (u32 nodeIndex = 0; nodeIndex < queue->nodesCount; ++nodeIndex)
+    {
+        NumaNode* node = queue->nodes + nodeIndex;
+        node->nextWorkOrderIndex = node->firstWorkOrder;
+    }
+}
+
+//rays per pixel of the next pass: doubles while there is time, the last
+//pass gets whatever still fits before the deadline. With less than a ray
+//per pixel left it is a single ray that the deadline cuts short, 0 only
+//once the deadline has passed
+internal u32
+planNextPass(const u32 previousSamplesCount, const f64 samplesPerSecond,
+    const f64 secondsLeft, const u64 pixelsCount)
+{
+    if (secondsLeft <= 0.0)
+    {
+        return 0;
+    }
+
+    f64 samplesThatFit = samplesPerSecond * secondsLeft / (f64)pixelsCount;
+    u32 res = 2 * previousSamplesCount;
+    if (samplesThatFit < (f64)res)
+    {
+        res = (u32)samplesThatFit;
+    }
+    if (!res)
+    {
+        res = 1;
+    }
+
+    return res;
+}
+
+//marks the cells of a box padded by one cell, see markSegment. Boxes that
+//reach out of the grid set outside.
+internal void
+markBox(TileFootprint* footprint, const FootprintGrid* grid, const v3& boxMin,
+    const v3& boxMax)
+{
+    f32 gridSize = grid->cellSize * footprintGridSide;
+    v3 low = boxMin - grid->min;
+    v3 high = boxMax - grid->min;
+    if (low.x < 0.0f || low.y < 0.0f || low.z < 0.0f
+        || high.x > gridSize || high.y > gridSize || high.z > gridSize)
+    {
+        footprint->outside = 1;
+    }
+
+    u32 minX = gridCellCoordinate(low.x / grid->cellSize - 1.0f);
+    u32 minY = gridCellCoordinate(low.y / grid->cellSize - 1.0f);
+    u32 minZ = gridCellCoordinate(low.z / grid->cellSize - 1.0f);
+    u32 maxX = gridCellCoordinate(high.x / grid->cellSize + 1.0f);
+    u32 maxY = gridCellCoordinate(high.y / grid->cellSize + 1.0f);
+    u32 maxZ = gridCellCoordinate(high.z / grid->cellSize + 1.0f);
+    for (u32 z = minZ; z <= maxZ; ++z)
+    {
+        for (u32 y = minY; y <= maxY; ++y)
+        {
+            for (u32 x = minX; x <= maxX; ++x)
+            {
+                markCell(footprint, x, y, z);
+            }
+        }
+    }
+}
+
+internal void
+markSphere(TileFootprint* footprint, const FootprintGrid* grid, const Sphere& sphere)
+{
+    v3 extent = v3(sphere.radius, sphere.radius, sphere.radius);
+    markBox(footprint, grid, sphere.pos - extent, sphere.pos + extent);
+}
+
+//cells the plane passes through, padded by one like markBox. Planes do not
+//end, so every segment that left the grid could reach them too.
+internal void
+markPlane(TileFootprint* footprint, const FootprintGrid* grid, const Plane& plane)
+{
+    footprint->outside = 1;
+
+    v3 normal = plane.normal;
+    f32 reach = 1.5f * grid->cellSize * (fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z));
+    for (u32 z = 0; z < footprintGridSide; ++z)
+    {
+        for (u32 y = 0; y < footprintGridSide; ++y)
+        {
+            for (u32 x = 0; x < footprintGridSide; ++x)
+            {
+                v3 center = grid->min + v3(x + 0.5f, y + 0.5f, z + 0.5f) * grid->cellSize;
+                if (fabsf(dot(normal, center) + plane.distanceAlong) <= reach)
+                {
+                    markCell(footprint, x, y, z);
+                }
+            }
+        }
+    }
+}
+
+//a cube around the spheres and the camera with as much room again on every
+//side for edits to move things into, past it footprints only know that a
+//segment left
+internal FootprintGrid
+makeFootprintGrid(const World* world, const Camera* camera)
+{
+    v3 boxMin = camera->position;
+    v3 boxMax = camera->position;
+    for (u32 sphereIndex = 0; sphereIndex < world->spheresCount; ++sphereIndex)
+    {
+        const Sphere* sphere = world->spheres + sphereIndex;
+        v3 extent = v3(sphere->radius, sphere->radius, sphere->radius);
+        v3 low = sphere->pos - extent;
+        v3 high = sphere->pos + extent;
+        boxMin = v3(low.x < boxMin.x ? low.x : boxMin.x, low.y < boxMin.y ? low.y : boxMin.y,
+            low.z < boxMin.z ? low.z : boxMin.z);
+        boxMax = v3(high.x > boxMax.x ? high.x : boxMax.x, high.y > boxMax.y ? high.y : boxMax.y,
+            high.z > boxMax.z ? high.z : boxMax.z);
+    }
+
+    v3 boxSize = boxMax - boxMin;
+    f32 size = boxSize.x;
+    size = boxSize.y > size ? boxSize.y : size;
+    size = boxSize.z > size ? boxSize.z : size;
+
+    FootprintGrid grid;
+    grid.min = (boxMin + boxMax) * 0.5f - v3(size, size, size);
+    grid.cellSize = 2.0f * size / footprintGridSide;
+    return grid;
+}
+
+//applies the edits to the world and its replicas, then marks up to date
+//every tile whose recorded paths miss all edited primitives and materials
+//and whose segments pass nowhere near an edited sphere or plane, before or
+//after the edit. Returns the number of tiles to re-render.
+internal u32
+applySceneEdits(WorkQueue* queue, World* world, const SceneEdit* edits,
+    const u32 editsCount)
+{
+    const FootprintGrid* grid = queue->footprintGrid;
+    TileFootprint edited = {};
+    u32 oldEmittersCount = world->emittersCount;
+
+    for (u32 editIndex = 0; editIndex < editsCount; ++editIndex)
+    {
+        const SceneEdit* edit = edits + editIndex;
+        switch (edit->type)
+        {
+            case SceneEdit_Material:
+            {
+                world->materials[edit->index] = edit->material;
+                markMaterial(&edited, edit->index);
+            } break;
+
+            case SceneEdit_Plane:
+            {
+                markPlane(&edited, grid, world->planes[edit->index]);
+                markPlane(&edited, grid, edit->plane);
+                world->planes[edit->index] = edit->plane;
+                markPrimitive(&edited, edit->index);
+            } break;
+
+            case SceneEdit_Sphere:
+            {
+                markSphere(&edited, grid, world->spheres[edit->index]);
+                markSphere(&edited, grid, edit->sphere);
+                world->spheres[edit->index] = edit->sphere;
+                markPrimitive(&edited, spherePrimitiveIndex(world, edit->index));
+            } break;
+        }
+    }
+
+    //light selection probabilities change for every diffuse hit
+    free(world->emitters);
+    buildEmitterList(world);
+    bool emittersChanged = world->emittersCount != oldEmittersCount;
+
+    for (u32 nodeIndex = 0; nodeIndex < queue->nodesCount; ++nodeIndex)
+    {
+        if (queue->nodes[nodeIndex].world)
+        {
+            updateReplica(queue->nodes[nodeIndex].world, world);
+        }
+    }
+
+    u32 invalidatedCount = 0;
+    for (u32 workOrderIndex = 0; workOrderIndex < queue->workOrdersCount; ++workOrderIndex)
+    {
+        WorkOrder* order = queue->workOrders + workOrderIndex;
+        bool invalidated = emittersChanged
+            || (order->footprint.primitives & edited.primitives)
+            || (order->footprint.materials & edited.materials)
+            || (order->footprint.outside & edited.outside);
+        for (u32 wordIndex = 0; wordIndex < arrayCount(edited.cells) && !invalidated; ++wordIndex)
+        {
+            invalidated = (order->footprint.cells[wordIndex] & edited.cells[wordIndex]) != 0;
+        }
+
+        order->upToDate = !invalidated;
+        if (invalidated)
+        {
+            memset(&order->footprint, 0, sizeof(order->footprint));
+            if (order->image.accumulators)
+            {
+                for (u32 y = order->minY; y < order->onePastYCount; ++y)
+                {
+                    PixelAccumulator* accumulator =
+                        getAccumulatorPointer(&order->image, order->minX, y);
+                    for (u32 x = order->minX; x < order->onePastXCount; ++x)
+                    {
+                        accumulator->radiance = v3(0, 0, 0);
+                        accumulator->samplesCount = 0;
+                        ++accumulator;
+                    }
+                }
+            }
+            ++invalidatedCount;
+        }
+    }
+
+    return invalidatedCount;
+}
+
+//claims the running job's indexes node-local first, then helps the others
+internal void
+runJobShare(ThreadContext* thread)
+{
+    WorkQueue* queue = thread->queue;
+    ParallelJob* job = queue->job;
+    for (u32 nodeOffset = 0; nodeOffset < queue->nodesCount; ++nodeOffset)
+    {
+        NumaNode* node = queue->nodes + (thread->nodeIndex + nodeOffset) % queue->nodesCount;
+        for (;;)
+        {
+            u64 index = lockedAddAndReturnPrev(&node->nextJobIndex, 1);
+            if (index >= node->onePastLastJobIndex)
+            {
+                break;
+            }
+            job->proc(job->data, (u32)index);
+        }
+    }
+}
+
+internal void*
+workerThread(void* param)
+{
+    ThreadContext* thread = (ThreadContext*)param;
+    WorkQueue* queue = thread->queue;
+    prepareWorker(thread);
+    if (profilingMode)
+    {
+        openCounters(&thread->profile);
+    }
+
+    for (;;)
+    {
+        pthread_barrier_wait(&queue->passBarrier);
+        if (queue->finished)
+        {
+            break;
+        }
+
+        if (queue->job)
+        {
+            runJobShare(thread);
+        }
+        else
+        {
+            while(renderTile(thread)) {};
+        }
+        pthread_barrier_wait(&queue->passBarrier);
+    }
+
+    closeCounters(&thread->profile);
+    return 0;
+}
+
+internal void
+createThread(ThreadContext* param)
+{
+    pthread_create(&param->handle, 0, workerThread, param);
+}
+
+//runs proc for every index in [0, count) on all workers and returns when
+//all are done. threads[0] calls it between passes, while the others wait
+//at passBarrier, each node's share goes to the node's own workers first
+internal void
+runParallel(ThreadContext* threads, void (*proc)(void* data, u32 index), void* data,
+    const u32 count)
+{
+    WorkQueue* queue = threads->queue;
+    ParallelJob job = {};
+    job.proc = proc;
+    job.data = data;
+    for (u32 nodeIndex = 0; nodeIndex < queue->nodesCount; ++nodeIndex)
+    {
+        NumaNode* node = queue->nodes + nodeIndex;
+        node->nextJobIndex = nodeShareStart(queue, nodeIndex, count);
+        node->onePastLastJobIndex = nodeShareStart(queue, nodeIndex + 1, count);
+    }
+
+    queue->job = &job;
+    pthread_barrier_wait(&queue->passBarrier);
+    runJobShare(threads);
+    pthread_barrier_wait(&queue->passBarrier);
+    queue->job = 0;
+}
+
+//cost-aware scheduling: bounces and shadow rays of one ray per 4x4 pixels,
+//a fraction of a percent of the frame's rays
+internal void
+estimateTileCostJob(void* data, u32 workOrderIndex)
+{
+    WorkOrder* order = (WorkOrder*)data + workOrderIndex;
+    const TiledImage* image = &order->image;
+    const Camera* camera = order->camera;
+
+    TileState tile = {};
+    tile.series.state = (workOrderIndex + 1) * 2654435761u;
+    for (u32 y = order->minY + 1; y < order->onePastYCount; y += 4)
+    {
+        f32 filmY = -1.0f + 2.0f*((f32)y / (f32)image->height);
+        for (u32 x = order->minX + 1; x < order->onePastXCount; x += 4)
+        {
+            f32 filmX = -1.0f + 2.0f*((f32)x / (f32)image->width);
+            v3 filmPoint = getFilmPoint(camera, filmX, filmY);
+            rayCast(order->world, camera->position,
+                normalize(filmPoint - camera->position), &tile);
+        }
+    }
+
+    order->estimatedCost = tile.bouncesComputed + tile.shadowRaysComputed;
+}
+
+//views in order, within a view the most expensive tiles first
+internal int
+compareWorkOrderCost(const void* a, const void* b)
+{
+    const WorkOrder* orderA = (const WorkOrder*)a;
+    const WorkOrder* orderB = (const WorkOrder*)b;
+    if (orderA->viewIndex != orderB->viewIndex)
+    {
+        return orderA->viewIndex < orderB->viewIndex ? -1 : 1;
+    }
+    if (orderA->estimatedCost != orderB->estimatedCost)
+    {
+        return orderA->estimatedCost > orderB->estimatedCost ? -1 : 1;
+    }
+    return 0;
+}
+
+internal void
+resolveTileRowJob(void* data, u32 tileY)
+{
+    resolveTileRow((TiledImage*)data, tileY);
+}
+
+//lines of every tile that measureOutput times, a sixteenth of the frame
+internal u32
+measuredLinesCount(const TiledImage* framebuffer)
+{
+    u32 res = framebuffer->tileHeight / 16;
+    return res ? res : 1;
+}
+
+//times resolve, swizzle and encode of a few lines of every tile row as
+//they are now and scales them to the frame. Rows go in parallel, so the
+//longest row can end after an even split of them, QOI is serial. The estimate
+//only grows: a warm or half rendered frame can time faster than the final
+//one. It only writes output pixels, the final resolve writes them again
+internal void
+measureOutput(WorkQueue* queue, TiledImage* framebuffer)
+{
+    Image* image = queue->outputImage;
+    u32 linesCount = measuredLinesCount(framebuffer);
+
+    u64 parallelNanoseconds = 0;
+    u64 longestRowNanoseconds = 0;
+    u64 serialNanoseconds = 0;
+    u64 bytes = 0;
+    u8* qoiData = (u8*)malloc(14 + (u64)image->width * linesCount * 4 + 8);
+    for (u32 tileY = 0; tileY < framebuffer->tileCountY; ++tileY)
+    {
+        u32 minY = tileY * framebuffer->tileHeight;
+        Image lines = *image;
+        lines.pixels = getPixelPointer(image, 0, minY);
+        lines.height = framebuffer->height - minY < linesCount
+            ? framebuffer->height - minY : linesCount;
+
+        u64 start = monotonicNanoseconds();
+        resolveTileRowLines(framebuffer, tileY, linesCount);
+        swizzleTileRowLines(framebuffer, image, tileY, linesCount);
+        if (outputFormat == OutputFormat_PNG)
+        {
+            PngStrip strip = {};
+            encodePngStrip(&lines, 0, lines.height, &strip);
+            bytes += strip.size;
+            free(strip.data);
+        }
+        u64 rowNanoseconds = monotonicNanoseconds() - start;
+        parallelNanoseconds += rowNanoseconds;
+        if (rowNanoseconds > longestRowNanoseconds)
+        {
+            longestRowNanoseconds = rowNanoseconds;
+        }
+
+        if (outputFormat == OutputFormat_QOI)
+        {
+            start = monotonicNanoseconds();
+            bytes += encodeQoi(lines, qoiData);
+            serialNanoseconds += monotonicNanoseconds() - start;
+        }
+        else if (outputFormat == OutputFormat_BMP)
+        {
+            bytes += (u64)lines.width * lines.height * 4;
+        }
+    }
+    free(qoiData);
+
+    //writes land in the page cache, a GB/s is slow for it
+    u64 res = parallelNanoseconds / coreCount + longestRowNanoseconds * (coreCount - 1) / coreCount
+        + serialNanoseconds + bytes;
+    res = res * framebuffer->tileHeight / linesCount;
+
+    //scheduling noise
+    res += res / 4 + 2000000;
+    if (res > queue->outputNanoseconds)
+    {
+        queue->outputNanoseconds = res;
+    }
+}
+
+//before the first pass there is nothing to time, so the measured lines
+//get noise, the worst case for the resolve and close to it for QOI and PNG,
+//and are cleared again
+internal void
+measureNoisyOutput(WorkQueue* queue, TiledImage* framebuffer)
+{
+    u32 linesCount = measuredLinesCount(framebuffer);
+    u64 tileArea = (u64)framebuffer->tileWidth * framebuffer->tileHeight;
+    u64 tilesCount = (u64)framebuffer->tileCountX * framebuffer->tileCountY;
+    u64 linesArea = (u64)linesCount * framebuffer->tileWidth;
+
+    randomSeries series;
+    series.state = 2654435761u;
+    for (u64 tileIndex = 0; tileIndex < tilesCount; ++tileIndex)
+    {
+        PixelAccumulator* accumulators = framebuffer->accumulators + tileIndex * tileArea;
+        for (u64 index = 0; index < linesArea; ++index)
+        {
+            accumulators[index].radiance = v3(randomUnilateral(&series),
+                randomUnilateral(&series), randomUnilateral(&series));
+            accumulators[index].samplesCount = 1;
+        }
+    }
+
+    measureOutput(queue, framebuffer);
+
+    PixelAccumulator empty = {};
+    for (u64 tileIndex = 0; tileIndex < tilesCount; ++tileIndex)
+    {
+        PixelAccumulator* accumulators = framebuffer->accumulators + tileIndex * tileArea;
+        for (u64 index = 0; index < linesArea; ++index)
+        {
+            accumulators[index] = empty;
+        }
+    }
+}
+
+//the output is reserved at the end of the budget, plus a fixed margin for
+//the pixels in flight, the pass barrier and waking the workers to resolve
+internal u64
+frameDeadline(const WorkQueue* queue, const u64 frameStart)
+{
+    return frameStart + (u64)timeBudgetMs * 1000000 - queue->outputNanoseconds
+        - deadlineMarginNanoseconds;
+}
+
+//renders every tile that is not up to date: one pass of raysPerPixel,
+//or progressive passes until frameStart + timeBudgetMs. threads[0] is the
+//calling thread, all coreCount workers follow it
+internal void
+renderFrame(WorkQueue* queue, ThreadContext* threads, TiledImage* framebuffer,
+    const u64 frameStart)
+{
+    u32 tilesCount = 0;
+    u64 pixelsCount = 0;
+    if (queue->tiffStream)
+    {
+        tilesCount = queue->workOrdersCount;
+        pixelsCount = (u64)framebuffer->width * framebuffer->height;
+    }
+    for (u32 workOrderIndex = 0; queue->workOrders && workOrderIndex < queue->workOrdersCount;
+        ++workOrderIndex)
+    {
+        WorkOrder* order = queue->workOrders + workOrderIndex;
+        if (!order->upToDate)
+        {
+            ++tilesCount;
+            pixelsCount += (u64)(order->onePastXCount - order->minX)
+                * (order->onePastYCount - order->minY);
+        }
+    }
+    if (!tilesCount)
+    {
+        return;
+    }
+
+    for (u32 threadIndex = 0; threadIndex < coreCount; ++threadIndex)
+    {
+        threads[threadIndex].busyNanoseconds = 0;
+    }
+    u64 tailIdleNanoseconds = 0;
+
+    u64 raycastingStart = monotonicNanoseconds();
+    u64 samplesComputedBefore = queue->samplesComputed;
+    queue->deadline = 0;
+    if (timeBudgetMs)
+    {
+        queue->deadline = frameDeadline(queue, frameStart);
+    }
+
+    u32 passSamplesCount = timeBudgetMs ? 1 : raysPerPixel;
+    for (u32 passIndex = 0; passSamplesCount; ++passIndex)
+    {
+        u64 passStart = monotonicNanoseconds();
+        queue->passIndex = passIndex;
+        beginPass(queue, passSamplesCount);
+        pthread_barrier_wait(&queue->passBarrier);
+
+        u64 progressPercent = 0;
+        while (renderTile(threads))
+        {
+            //out-of-core frames can have millions of tiles, report per percent
+            u64 retiredCount = queue->tilesRetiredCount;
+            bool report = !queue->tiffStream || retiredCount * 100 / tilesCount != progressPercent;
+            if (!timeBudgetMs && !queue->views && report)
+            {
+                progressPercent = retiredCount * 100 / tilesCount;
+                std::cout<<"Raycasting progress... "<<retiredCount <<"/" << tilesCount << " tiles" <<std::endl;
+            }
+        }
+        pthread_barrier_wait(&queue->passBarrier);
+
+        //time the other workers waited on the one that finished last
+        u64 lastEnd = passStart;
+        for (u32 threadIndex = 0; threadIndex < coreCount; ++threadIndex)
+        {
+            if (threads[threadIndex].lastRectEnd > lastEnd)
+            {
+                lastEnd = threads[threadIndex].lastRectEnd;
+            }
+        }
+        for (u32 threadIndex = 0; threadIndex < coreCount; ++threadIndex)
+        {
+            u64 end = threads[threadIndex].lastRectEnd;
+            tailIdleNanoseconds += lastEnd - (end > passStart ? end : passStart);
+        }
+
+        if (!timeBudgetMs)
+        {
+            break;
+        }
+
+        u64 passEnd = monotonicNanoseconds();
+        std::cout<<"Pass "<<passIndex<<": "<<passSamplesCount<<" rays per pixel in "
+            <<(passEnd - passStart) / 1000000.0<<"ms"<<std::endl;
+
+        f64 samplesPerSecond = (f64)(queue->samplesComputed - samplesComputedBefore) * 1e9
+            / (f64)(passEnd - raycastingStart);
+
+        //the output is timed again on what has been rendered so far. A pass
+        //cut by the deadline leaves nothing to plan, timing it then would
+        //only add to the overrun
+        u64 now = monotonicNanoseconds();
+        if (now < queue->deadline)
+        {
+            measureOutput(queue, framebuffer);
+            queue->deadline = frameDeadline(queue, frameStart);
+            now = monotonicNanoseconds();
+        }
+        f64 secondsLeft = now < queue->deadline ? (queue->deadline - now) / 1e9 : 0.0;
+        passSamplesCount = planNextPass(passSamplesCount, samplesPerSecond,
+            secondsLeft, pixelsCount);
+    }
+
+    u64 raycastingEnd = monotonicNanoseconds();
+    u64 busyNanoseconds = 0;
+    for (u32 threadIndex = 0; threadIndex < coreCount; ++threadIndex)
+    {
+        busyNanoseconds += threads[threadIndex].busyNanoseconds;
+    }
+    f64 coreMilliseconds = (f64)(raycastingEnd - raycastingStart) * coreCount / 1000000.0;
+    std::cout<<"Tail idle: "<<tailIdleNanoseconds / 1000000.0<<"ms of "<<coreMilliseconds
+        <<"ms core time ("<<tailIdleNanoseconds / 10000.0 / coreMilliseconds<<"%). Work / cores: "
+        <<busyNanoseconds / 1000000.0 / coreCount<<"ms, raycasting: "
+        <<(raycastingEnd - raycastingStart) / 1000000.0<<"ms."<<std::endl;
+
+    if (timeBudgetMs)
+    {
+        runParallel(threads, resolveTileRowJob, framebuffer, framebuffer->tileCountY);
+    }
+}
+
+struct SwizzleJob
+{
+    TiledImage* source;
+    Image* dest;
+};
+
+internal void
+swizzleTileRowJob(void* data, u32 tileY)
+{
+    SwizzleJob* job = (SwizzleJob*)data;
+    swizzleTileRow(job->source, job->dest, tileY);
+}
+
+internal void
+prefaultTileRowJob(void* data, u32 tileY)
+{
+    SwizzleJob* job = (SwizzleJob*)data;
+    prefaultTileRow(job->source, job->dest, tileY);
+}
+
+internal void
+encodePngTileRowJob(void* data, u32 tileY)
+{
+    PngStream* stream = (PngStream*)data;
+    if (!stream->strips[stream->stripsCount - 1 - tileY].data)
+    {
+        encodePngTileRow(stream, tileY);
+    }
+}
+
+internal void
+initPngStream(PngStream* stream, const TiledImage* source, Image* image)
+{
+    stream->source = source;
+    stream->image = image;
+    stream->stripsCount = source->tileCountY;
+    stream->strips = (PngStrip*)calloc(stream->stripsCount, sizeof(PngStrip));
+    stream->tilesRetired = (volatile u64*)calloc(stream->stripsCount, sizeof(u64));
+}
+
+internal void
+resetPngStream(PngStream* stream)
+{
+    for (u32 stripIndex = 0; stripIndex < stream->stripsCount; ++stripIndex)
+    {
+        free(stream->strips[stripIndex].data);
+        stream->strips[stripIndex].data = 0;
+        stream->tilesRetired[stripIndex] = 0;
+    }
+}
+
+internal void
+freePngStream(PngStream* stream)
+{
+    resetPngStream(stream);
+    free(stream->strips);
+    free((void*)stream->tilesRetired);
+}
+
+internal void
+writePngChunk(FILE* outFile, const char* type, const u8* data, const u32 size)
+{
+    u8* chunk = (u8*)malloc(size + 12);
+    putBigEndian32(chunk, size);
+    memcpy(chunk + 4, type, 4);
+    if (size)
+    {
+        memcpy(chunk + 8, data, size);
+    }
+    putBigEndian32(chunk + 8 + size, crc32(chunk + 4, size + 4));
+    fwrite(chunk, size + 12, 1, outFile);
+    free(chunk);
+}
+
+//stitches one IDAT per encoded strip between the zlib header and trailer
+internal u64
+writePng(PngStream* stream, const char* filename)
+{
+    FILE* outFile = fopen(filename, "wb");
+    if (!outFile)
+    {
+        std::cout <<"unable to write output file "<< filename << "!" << std::endl;
+        return 0;
+    }
+
+    u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, sizeof(signature), 1, outFile);
+
+    u8 header[13] = {};
+    putBigEndian32(header, stream->image->width);
+    putBigEndian32(header + 4, stream->image->height);
+    header[8] = 8; //bit depth
+    header[9] = 2; //RGB
+    writePngChunk(outFile, "IHDR", header, sizeof(header));
+
+    u8 zlibHeader[2] = {0x78, 0x01};
+    writePngChunk(outFile, "IDAT", zlibHeader, sizeof(zlibHeader));
+
+    u32 adler = 1;
+    for (u32 stripIndex = 0; stripIndex < stream->stripsCount; ++stripIndex)
+    {
+        PngStrip* strip = stream->strips + stripIndex;
+        fwrite(strip->data, strip->size, 1, outFile);
+        adler = adler32Combine(adler, strip->adler, strip->rawSize);
+    }
+
+    //final empty fixed huffman block, then the checksum
+    u8 trailer[6] = {0x03, 0x00};
+    putBigEndian32(trailer + 2, adler);
+    writePngChunk(outFile, "IDAT", trailer, sizeof(trailer));
+    writePngChunk(outFile, "IEND", 0, 0);
+
+    u64 size = ftell(outFile);
+    fclose(outFile);
+
+    return size;
+}
+
+//writes baseName plus the extension of outputFormat and reports the size
+internal void
+writeOutput(Image* image, PngStream* pngStream, const char* baseName)
+{
+    const char* extensions[] = {"bmp", "qoi", "png"};
+    char filename[272];
+    snprintf(filename, sizeof(filename), "%s.%s", baseName, extensions[outputFormat]);
+
+    u64 start = monotonicNanoseconds();
+    u64 size = 0;
+    switch (outputFormat)
+    {
+        case OutputFormat_BMP:
+        {
+            writeImage(*image, filename);
+            size = sizeof(BitmapHeader) + totalPixelSize(*image);
+        } break;
+
+        case OutputFormat_QOI:
+        {
+            size = writeQoi(*image, filename);
+        } break;
+
+        case OutputFormat_PNG:
+        {
+            size = writePng(pngStream, filename);
+        } break;
+    }
+    u64 end = monotonicNanoseconds();
+
+    //one insertion, batch views finish on different threads
+    char report[512];
+    f64 rawMegabytes = (f64)image->width * image->height * 3 / (1024.0 * 1024.0);
+    u32 reportSize = snprintf(report, sizeof(report), "Wrote %s: %g MB, %g MB/s.\n",
+        filename, size / (1024.0 * 1024.0), rawMegabytes * 1e9 / (end - start));
+
+    if (outputFormat == OutputFormat_PNG)
+    {
+        u64 stripNanoseconds = 0;
+        for (u32 stripIndex = 0; stripIndex < pngStream->stripsCount; ++stripIndex)
+        {
+            stripNanoseconds += pngStream->strips[stripIndex].encodeNanoseconds;
+        }
+        snprintf(report + reportSize, sizeof(report) - reportSize,
+            "PNG strips: %gms of encoding, %g MB/s per core.\n",
+            stripNanoseconds / 1000000.0, rawMegabytes * 1e9 / stripNanoseconds);
+    }
+    std::cout<<report<<std::flush;
+}
+
+internal void
+writeView(View* view)
+{
+    writeOutput(&view->image, &view->png, view->outputName);
+
+    if (outputFormat == OutputFormat_PNG)
+    {
+        freePngStream(&view->png);
+    }
+    freeImage(&view->framebuffer);
+    freeImage(&view->image);
+}
+
+//runs on the worker that retired the view's last tile while the others
+//keep rendering the next views, so everything here is single threaded
+internal void
+finishView(View* view)
+{
+    for (u32 tileY = 0; tileY < view->framebuffer.tileCountY; ++tileY)
+    {
+        swizzleTileRow(&view->framebuffer, &view->image, tileY);
+        if (outputFormat == OutputFormat_PNG)
+        {
+            encodePngTileRow(&view->png, tileY);
+        }
+    }
+
+    writeView(view);
+}
+
+//views whose last tile retired after the queue drained, the last one at
+//least: swizzle and encode run on all workers between passes
+internal void
+finishDrainedViews(ThreadContext* threads, View* views, const u32 viewsCount)
+{
+    for (u32 viewIndex = 0; viewIndex < viewsCount; ++viewIndex)
+    {
+        View* view = views + viewIndex;
+        if (!view->drained)
+        {
+            continue;
+        }
+
+        SwizzleJob swizzle = {};
+        swizzle.source = &view->framebuffer;
+        swizzle.dest = &view->image;
+        runParallel(threads, swizzleTileRowJob, &swizzle, view->framebuffer.tileCountY);
+        if (outputFormat == OutputFormat_PNG)
+        {
+            runParallel(threads, encodePngTileRowJob, &view->png, view->png.stripsCount);
+        }
+
+        writeView(view);
+    }
+}
+
+int main(const int argc, const char** argv)
+{
+    timespec startOfTheWholeProgram;
+    clock_gettime(CLOCK_MONOTONIC, &startOfTheWholeProgram);
+
+    Material materials[9] = {};
+    materials[0].emitColor = v3(0.1f, 0.1f, 0.9f);
+    materials[1].refColor = v3(0.1f, 0.9f, 0.1f);
+    materials[2].refColor = v3(0.7f, 0.5f, 0.3f);
+    materials[3].emitColor = v3(1.0f, 0.0f, 0.0f) * 8.0f;
+    materials[4].refColor = v3(0.2f, 0.8f, 0.2f);
+    materials[4].shininess = 0.7f;
+    materials[5].refColor = v3(0.4f, 0.8f, 0.9f);
+    materials[5].shininess = 0.85f;
+    materials[6].refColor = v3(1.0f, 1.0f, 1.0f);
+    materials[6].shininess = 1.0f;
+    materials[7].emitColor = v3(1.0f, 1.0f, 1.0f) * 16.0f;
+    materials[7].refColor = v3(0.0f, 0.0f, 0.0f);
+    materials[7].shininess = 1.0f;
+    materials[8].refColor = v3(0.0f, 0.8f, 0.3f);
+    materials[8].shininess = 0.99f;
+    
+    Plane planes[1] = {};
+    planes[0].normal = v3(0, 0, 1);
     planes[0].distanceAlong = 0;
     planes[0].matIndex = 2;
 
@@ -450,109 +3404,494 @@ int main(const int argc, const char** argv)
     world.spheresCount = arrayCount(spheres);
     world.planes = planes;
     world.spheres = spheres;
+    buildEmitterList(&world);
 
-    Image image = allocateImage(outputWidth, outputHeight);
-
-    u32 tileWidth = image.width / coreCount;
+    u32 tileWidth = outputWidth / coreCount;
     u32 tileHeight = tileWidth;
     if (tileDimension)
     {
         tileHeight = tileWidth = tileDimension;
     }
-    u32 tileCountX = (image.width + tileWidth - 1) / tileWidth;
-    u32 tileCountY = (image.height + tileHeight - 1) / tileHeight;
+
+    //out-of-core: one frame, fixed ray count, TIFF tiles are multiples of 16
+    if (outOfCore)
+    {
+        if (batchRender || timeBudgetMs || incrementalRerender || costAwareScheduling
+            || outputFormat != OutputFormat_BMP)
+        {
+            std::cout<<"Out-of-core mode ignores the batch, the time budget, the scene edit,"
+                " cost-aware scheduling and outputFormat, it always writes a tiled BigTIFF."<<std::endl;
+            batchRender = false;
+            timeBudgetMs = 0;
+            incrementalRerender = false;
+            costAwareScheduling = false;
+            outputFormat = OutputFormat_BMP;
+        }
+        tileWidth = (tileWidth + 15) & ~15u;
+        tileHeight = (tileHeight + 15) & ~15u;
+    }
+
+    //a batch takes every view at the fixed ray count through one queue
+    u32 viewsCount = 1;
+    if (batchRender)
+    {
+        viewsCount = orbitViewsCount ? orbitViewsCount : arrayCount(batchViews);
+    }
+    if (batchRender && (timeBudgetMs || incrementalRerender))
+    {
+        std::cout<<"Batch mode ignores the time budget and the scene edit."<<std::endl;
+        timeBudgetMs = 0;
+        incrementalRerender = false;
+    }
+
+    //orbiting views keep the single view's distance and height
+    View* views = (View*)calloc(viewsCount, sizeof(View));
+    for (u32 viewIndex = 0; viewIndex < viewsCount; ++viewIndex)
+    {
+        View* view = views + viewIndex;
+        v3 cameraPosition = v3(0, -10, 1);
+        if (batchRender && orbitViewsCount)
+        {
+            f32 angle = 2.0f * Pi32 * viewIndex / viewsCount;
+            cameraPosition = v3(10.0f * sinf(angle), -10.0f * cosf(angle), 1);
+            snprintf(view->outputName, sizeof(view->outputName), "view_%03u", viewIndex);
+        }
+        else if (batchRender)
+        {
+            cameraPosition = batchViews[viewIndex].cameraPosition;
+            snprintf(view->outputName, sizeof(view->outputName), "%s",
+                batchViews[viewIndex].outputPath);
+        }
+        else
+        {
+            snprintf(view->outputName, sizeof(view->outputName), "beauty");
+        }
+        view->camera = makeCamera(cameraPosition, outputWidth, outputHeight);
+        if (outOfCore)
+        {
+            view->framebuffer = tiledImageLayout(outputWidth, outputHeight, tileWidth, tileHeight);
+        }
+        else
+        {
+            view->framebuffer = allocateTiledImage(outputWidth, outputHeight,
+                tileWidth, tileHeight, timeBudgetMs != 0);
+            view->image = allocateImage(outputWidth, outputHeight);
+        }
+        view->tilesCount = view->framebuffer.tileCountX * view->framebuffer.tileCountY;
+    }
+    TiledImage& framebuffer = views[0].framebuffer;
+    Image& image = views[0].image;
+    PngStream& pngStream = views[0].png;
+    u32 tileCountX = framebuffer.tileCountX;
+    u32 tileCountY = framebuffer.tileCountY;
     u32 totalTiles = tileCountX * tileCountY;
 
     WorkQueue queue = {};
-    queue.workOrders = (WorkOrder*)malloc(totalTiles * sizeof(WorkOrder));
+    if (!outOfCore)
+    {
+        queue.workOrders = (WorkOrder*)malloc(viewsCount * totalTiles * sizeof(WorkOrder));
+    }
+    queue.numaAware = numaAware;
+
+    if (numaAware)
+    {
+        detectNumaNodes(&queue);
+    }
+    else
+    {
+        queue.nodesCount = 1;
+        queue.nodes = (NumaNode*)calloc(1, sizeof(NumaNode));
+        queue.nodes[0].cpuCount = get_nprocs();
+    }
 
-    coreCount = get_nprocs();
+    coreCount = 0;
+    for (u32 nodeIndex = 0; nodeIndex < queue.nodesCount; ++nodeIndex)
+    {
+        coreCount += queue.nodes[nodeIndex].cpuCount;
+    }
 
     std::cout<<std::endl;
     std::cout<<"CONFIGURATION: " << outputWidth<<"x"<<outputHeight<<" output image size. "<<std::endl;
-    std::cout<<"Raycasting depth is "<<raycastingDepth<<". "<<raysPerPixel<<" rays per one pixel."<<std::endl;
+    if (timeBudgetMs)
+    {
+        std::cout<<"Raycasting depth is "<<raycastingDepth<<". Time budget "<<timeBudgetMs<<"ms."<<std::endl;
+    }
+    else
+    {
+        std::cout<<"Raycasting depth is "<<raycastingDepth<<". "<<raysPerPixel<<" rays per one pixel."<<std::endl;
+    }
     std::cout<<coreCount<<" cores. One render tile: "<< tileWidth<< "x" <<tileHeight<<"."<<std::endl;
     std::cout<<"Tiles x: "<<tileCountX<<".Tiles y: "<<tileCountY<<". "<<std::endl;
     std::cout<<"Total number of tiles: "<< totalTiles<<". "<<std::endl;
+    if (batchRender)
+    {
+        std::cout<<"Batch of "<<viewsCount<<" views, "<<viewsCount * totalTiles<<" tiles."<<std::endl;
+    }
+    if (numaAware)
+    {
+        std::cout<<"NUMA nodes: "<<queue.nodesCount<<"."<<std::endl;
+    }
+    if (outOfCore)
+    {
+        std::cout<<"Out-of-core: "<<coreCount<<" tile buffers of "
+            <<tileWidth * tileHeight * 7 / 1024<<" KB, tiles streamed to "
+            <<views[0].outputName<<".tif."<<std::endl;
+    }
     std::cout<<std::endl;
 
     timespec startOfRaycasting;
     clock_gettime(CLOCK_MONOTONIC, &startOfRaycasting);
 
-    for (u32 tileY = 0; tileY < tileCountY; ++tileY)
+    //view by view, so the tail of one view overlaps the start of the next,
+    //out-of-core frames make their orders as they are taken instead
+    TiffStream tiffStream = {};
+    if (outOfCore)
     {
-        u32 minY = tileY * tileHeight;
-        u32 onePastMaxY = minY + tileHeight;
-        if (onePastMaxY > image.height)
+        tiffStream.prototype.world = &world;
+        tiffStream.prototype.camera = &views[0].camera;
+        tiffStream.prototype.image = framebuffer;
+
+        char tiffName[272];
+        snprintf(tiffName, sizeof(tiffName), "%s.tif", views[0].outputName);
+        if (!openTiffStream(&tiffStream, tiffName))
         {
-            onePastMaxY = image.height;
+            return 1;
         }
-
-        for (u32 tileX = 0; tileX < tileCountX; ++tileX)
+        queue.tiffStream = &tiffStream;
+        queue.workOrdersCount = totalTiles;
+    }
+    for (u32 viewIndex = 0; viewIndex < viewsCount && queue.workOrders; ++viewIndex)
+    {
+        View* view = views + viewIndex;
+        for (u32 tileY = 0; tileY < tileCountY; ++tileY)
         {
-            u32 minX = tileX * tileWidth;
-            u32 onePastMaxX = minX + tileWidth;
-            if (onePastMaxX > image.width)
+            u32 minY = tileY * tileHeight;
+            u32 onePastMaxY = minY + tileHeight;
+            if (onePastMaxY > framebuffer.height)
             {
-                onePastMaxX = image.width;
+                onePastMaxY = framebuffer.height;
             }
 
-            WorkOrder* order = queue.workOrders + queue.workOrdersCount++;
-            order->world = &world;
-            order->image = image;
-            order->series.state = tileY * tileX;
-            order->minX = minX;
-            order->minY = minY;
-            order->onePastXCount = onePastMaxX;
-            order->onePastYCount = onePastMaxY;
+            for (u32 tileX = 0; tileX < tileCountX; ++tileX)
+            {
+                u32 minX = tileX * tileWidth;
+                u32 onePastMaxX = minX + tileWidth;
+                if (onePastMaxX > framebuffer.width)
+                {
+                    onePastMaxX = framebuffer.width;
+                }
+
+                WorkOrder* order = queue.workOrders + queue.workOrdersCount++;
+                order->world = &world;
+                order->viewIndex = viewIndex;
+                order->camera = &view->camera;
+                order->image = view->framebuffer;
+                order->series.state = tileY * tileX;
+                order->minX = minX;
+                order->minY = minY;
+                order->onePastXCount = onePastMaxX;
+                order->onePastYCount = onePastMaxY;
+                memset(&order->footprint, 0, sizeof(order->footprint));
+                order->upToDate = false;
+                order->tilePixels = 0;
+                order->estimatedCost = 0;
+                order->nextSubTile = 0;
+                order->subTilesRetired = 0;
+            }
+        }
+    }
+
+    assignNodeWorkOrders(&queue);
+    if (numaAware)
+    {
+        pthread_barrier_init(&queue.firstTouchBarrier, 0, coreCount);
+    }
+    pthread_barrier_init(&queue.passBarrier, 0, coreCount);
+
+    //main thread is the first worker of node 0
+    ThreadContext* threads = (ThreadContext*)calloc(coreCount, sizeof(ThreadContext));
+    u32 threadsCount = 0;
+    for (u32 nodeIndex = 0; nodeIndex < queue.nodesCount; ++nodeIndex)
+    {
+        for (u32 nodeWorkerIndex = 0;
+            nodeWorkerIndex < queue.nodes[nodeIndex].cpuCount;
+            ++nodeWorkerIndex)
+        {
+            ThreadContext* thread = threads + threadsCount;
+            ++threadsCount;
+            thread->queue = &queue;
+            thread->nodeIndex = nodeIndex;
+            thread->nodeWorkerIndex = nodeWorkerIndex;
+            for (u32 counterIndex = 0; counterIndex < arrayCount(thread->profile.counterFds); ++counterIndex)
+            {
+                thread->profile.counterFds[counterIndex] = -1;
+            }
+            if (outOfCore)
+            {
+                thread->tilePixels = (u32*)malloc(tileWidth * tileHeight * sizeof(u32));
+                thread->tileBytes = (u8*)malloc(tileWidth * tileHeight * 3);
+            }
         }
     }
 
     //memory fence
-    lockedAddAndReturnPrev(&queue.nextWorkOrderIndex, 0);
+    lockedAddAndReturnPrev(&queue.nodes[0].nextWorkOrderIndex, 0);
     for(u32 coreIndex = 1; coreIndex < coreCount; ++coreIndex)
     {
-        createThread(&queue);
+        createThread(threads + coreIndex);
+    }
+
+    prepareWorker(threads);
+    if (profilingMode)
+    {
+        openCounters(&threads[0].profile);
+        if (threads[0].profile.counterFds[0] < 0)
+        {
+            std::cout<<"Hardware counters unavailable, profiling timeline only."<<std::endl;
+        }
+    }
+
+    //the workers wait at passBarrier from here on, the pre-pass runs on them
+    if (costAwareScheduling)
+    {
+        runParallel(threads, estimateTileCostJob, queue.workOrders, queue.workOrdersCount);
+
+        u64 totalCost = 0;
+        for (u32 workOrderIndex = 0; workOrderIndex < queue.workOrdersCount; ++workOrderIndex)
+        {
+            totalCost += queue.workOrders[workOrderIndex].estimatedCost;
+        }
+        for (u32 nodeIndex = 0; nodeIndex < queue.nodesCount; ++nodeIndex)
+        {
+            NumaNode* node = queue.nodes + nodeIndex;
+            qsort(queue.workOrders + node->firstWorkOrder,
+                node->onePastLastWorkOrder - node->firstWorkOrder,
+                sizeof(WorkOrder), compareWorkOrderCost);
+        }
+
+        //oversized: more than a quarter of one core's share, the tail such a
+        //tile leaves is worth splitting. Sub-tiles restart their sequence
+        //every pass, so progressive passes only get the ordering
+        u32 oversizedCount = 0;
+        if (!timeBudgetMs)
+        {
+            queue.splitOrders = (WorkOrder**)calloc(queue.workOrdersCount, sizeof(WorkOrder*));
+            queue.splitCostThreshold = totalCost / (4 * coreCount);
+            for (u32 workOrderIndex = 0; workOrderIndex < queue.workOrdersCount; ++workOrderIndex)
+            {
+                oversizedCount += queue.workOrders[workOrderIndex].estimatedCost
+                    > queue.splitCostThreshold;
+            }
+        }
+        std::cout<<"Cost-aware scheduling: most expensive tiles first, "<<oversizedCount
+            <<" oversized tiles split "<<subTilesPerSide<<"x"<<subTilesPerSide<<"."<<std::endl;
+        std::cout<<std::endl;
     }
 
-    while (queue.tilesRetiredCount < totalTiles)
+    u64 programStart = (u64)startOfTheWholeProgram.tv_sec * 1000000000ull
+        + startOfTheWholeProgram.tv_nsec;
+    if (outputFormat == OutputFormat_PNG && !outOfCore)
     {
-        if (renderTile(&queue))
+        initEncoderTables();
+        for (u32 viewIndex = 0; viewIndex < viewsCount; ++viewIndex)
         {
-            std::cout<<"Raycasting progress... "<<queue.tilesRetiredCount <<"/" << totalTiles << " tiles" <<std::endl;
+            initPngStream(&views[viewIndex].png, &views[viewIndex].framebuffer,
+                &views[viewIndex].image);
         }
+
+        //progressive passes revisit every tile, only a single pass can stream
+        if (!timeBudgetMs && !batchRender)
+        {
+            queue.pngStream = &pngStream;
+        }
+    }
+
+    //views write themselves out as their last tile retires
+    if (batchRender)
+    {
+        queue.views = views;
+    }
+
+    FootprintGrid footprintGrid = {};
+    if (incrementalRerender)
+    {
+        footprintGrid = makeFootprintGrid(&world, &views[0].camera);
+        queue.footprintGrid = &footprintGrid;
+    }
+
+    SwizzleJob swizzle = {};
+    swizzle.source = &framebuffer;
+    swizzle.dest = &image;
+    if (timeBudgetMs)
+    {
+        //page faults on the untouched output would land after the deadline
+        runParallel(threads, prefaultTileRowJob, &swizzle, tileCountY);
+        queue.outputImage = &image;
+        measureNoisyOutput(&queue, &framebuffer);
+    }
+
+    renderFrame(&queue, threads, &framebuffer, programStart);
+    if (queue.views)
+    {
+        finishDrainedViews(threads, views, viewsCount);
     }
 
     timespec endOfRaycasting;
     clock_gettime(CLOCK_MONOTONIC, &endOfRaycasting);
 
-    writeImage(image, "beauty.bmp");
+    //streamed strips swizzled their rows as they retired
+    if (!queue.pngStream && !queue.views && !queue.tiffStream)
+    {
+        runParallel(threads, swizzleTileRowJob, &swizzle, tileCountY);
+    }
+    queue.pngStream = 0;
+
+    timespec endOfSwizzle;
+    clock_gettime(CLOCK_MONOTONIC, &endOfSwizzle);
+
+    if (queue.tiffStream)
+    {
+        u64 tiffSize = closeTiffStream(&tiffStream);
+        if (tiffSize)
+        {
+            std::cout<<"Wrote "<<views[0].outputName<<".tif: "<<tiffSize / (1024.0 * 1024.0)
+                <<" MB while raycasting."<<std::endl;
+        }
+        else
+        {
+            std::cout<<"unable to write output file "<<views[0].outputName<<".tif!"<<std::endl;
+        }
+    }
+    else if (!queue.views)
+    {
+        //strips that did not stream out during rendering
+        if (outputFormat == OutputFormat_PNG)
+        {
+            runParallel(threads, encodePngTileRowJob, &pngStream, pngStream.stripsCount);
+        }
+        writeOutput(&image, &pngStream, views[0].outputName);
+    }
 
     timespec endOfTheWholeProgram;
     clock_gettime(CLOCK_MONOTONIC, &endOfTheWholeProgram);
 
     f32 initTime = startOfRaycasting.tv_sec - startOfTheWholeProgram.tv_sec;
     f32 raycastingTime = endOfRaycasting.tv_sec - startOfRaycasting.tv_sec;
-    f32 imageWritingTime = endOfTheWholeProgram.tv_sec - endOfRaycasting.tv_sec;
+    f32 swizzleTime = endOfSwizzle.tv_sec - endOfRaycasting.tv_sec;
+    f32 imageWritingTime = endOfTheWholeProgram.tv_sec - endOfSwizzle.tv_sec;
     initTime += (startOfRaycasting.tv_nsec - startOfTheWholeProgram.tv_nsec)/1000000000.0f;
     raycastingTime += (endOfRaycasting.tv_nsec - startOfRaycasting.tv_nsec)/1000000000.0f;
-    imageWritingTime += (endOfTheWholeProgram.tv_nsec - endOfRaycasting.tv_nsec)/1000000000.0f;
+    swizzleTime += (endOfSwizzle.tv_nsec - endOfRaycasting.tv_nsec)/1000000000.0f;
+    imageWritingTime += (endOfTheWholeProgram.tv_nsec - endOfSwizzle.tv_nsec)/1000000000.0f;
 
     initTime = initTime * 1000;
     raycastingTime = raycastingTime * 1000;
+    swizzleTime = swizzleTime * 1000;
     imageWritingTime = imageWritingTime * 1000;
 
     std::cout<<std::endl;
     std::cout<<"Init time: "<< initTime << "ms" << std::endl;
     std::cout<<"Raycasting time: "<< raycastingTime << "ms" << std::endl;
+    std::cout<<"Swizzle time: "<< swizzleTime << "ms" << std::endl;
     std::cout<<"Image writing time: "<< imageWritingTime << "ms" << std::endl;
     std::cout<<std::endl;
     std::cout<<"Total bounces: "<< queue.bouncesComputed<<std::endl;
+    std::cout<<"Total shadow rays: "<< queue.shadowRaysComputed<<std::endl;
     std::cout<<"Performance: " << (f64)raycastingTime * 1000 / queue.bouncesComputed << " ms/bounce" << std::endl;
+    std::cout<<"Peak RSS: "<< peakResidentBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+    if (timeBudgetMs)
+    {
+        f32 totalTime = initTime + raycastingTime + swizzleTime + imageWritingTime;
+        u64 pixelsCount = (u64)outputWidth * outputHeight;
+        std::cout<<"Achieved rays per pixel: "<<(f64)queue.samplesComputed / pixelsCount<<std::endl;
+        std::cout<<"Time budget: "<<timeBudgetMs<<"ms, used "<<totalTime<<"ms"
+            <<(totalTime > timeBudgetMs ? " (LATE)" : "")<<", output estimated "
+            <<queue.outputNanoseconds / 1000000.0<<"ms"<<std::endl;
+    }
+    if (batchRender)
+    {
+        //views were written during raycasting, so that is the batch time
+        std::cout<<"Batch: "<<viewsCount<<" views, "<<viewsCount * 1000.0f / raycastingTime
+            <<" views/s, "<<raycastingTime / viewsCount<<"ms per view."<<std::endl;
+    }
     std::cout<<std::endl;
 
-    free(image.pixels);
+    if (incrementalRerender)
+    {
+        //recolor the glossy green sphere
+        SceneEdit edits[1] = {};
+        edits[0].type = SceneEdit_Material;
+        edits[0].index = 4;
+        edits[0].material = materials[4];
+        edits[0].material.refColor = v3(0.8f, 0.3f, 0.1f);
+
+        u64 editStart = monotonicNanoseconds();
+        u64 samplesBeforeEdit = queue.samplesComputed;
+        u32 invalidatedCount = applySceneEdits(&queue, &world, edits, arrayCount(edits));
+        renderFrame(&queue, threads, &framebuffer, editStart);
+        runParallel(threads, swizzleTileRowJob, &swizzle, tileCountY);
+        if (outputFormat == OutputFormat_PNG)
+        {
+            resetPngStream(&pngStream);
+            runParallel(threads, encodePngTileRowJob, &pngStream, pngStream.stripsCount);
+        }
+        writeOutput(&image, &pngStream, "beauty_edit");
+        u64 editEnd = monotonicNanoseconds();
+
+        u64 editSamples = queue.samplesComputed - samplesBeforeEdit;
+        std::cout<<"Scene edit: "<<invalidatedCount<<"/"<<totalTiles<<" tiles re-rendered in "
+            <<(editEnd - editStart) / 1000000.0<<"ms."<<std::endl;
+        std::cout<<"Camera rays traced: "<<editSamples<<" vs "<<samplesBeforeEdit
+            <<" for the full frame ("<<100.0 * editSamples / samplesBeforeEdit<<"%)."<<std::endl;
+        std::cout<<std::endl;
+    }
+
+    queue.finished = true;
+    pthread_barrier_wait(&queue.passBarrier);
+
+    //workers close their counters on the way out, their contexts go below
+    for (u32 coreIndex = 1; coreIndex < coreCount; ++coreIndex)
+    {
+        pthread_join(threads[coreIndex].handle, 0);
+    }
+    pthread_barrier_destroy(&queue.passBarrier);
+    if (numaAware)
+    {
+        pthread_barrier_destroy(&queue.firstTouchBarrier);
+    }
+
+    if (profilingMode)
+    {
+        closeCounters(&threads[0].profile);
+        printProfile(threads, coreCount);
+        writeTrace(threads, coreCount, programStart, "trace.json");
+        for (u32 threadIndex = 0; threadIndex < coreCount; ++threadIndex)
+        {
+            free(threads[threadIndex].profile.events);
+        }
+    }
+
+    //batch views freed themselves once written, out-of-core frames had none
+    if (!batchRender && !outOfCore)
+    {
+        if (outputFormat == OutputFormat_PNG)
+        {
+            freePngStream(&pngStream);
+        }
+        freeImage(&framebuffer);
+        freeImage(&image);
+    }
+    for (u32 threadIndex = 0; threadIndex < coreCount; ++threadIndex)
+    {
+        free(threads[threadIndex].tilePixels);
+        free(threads[threadIndex].tileBytes);
+    }
+    free(threads);
+    freeNumaNodes(&queue);
+    free(views);
+    free(queue.splitOrders);
     free(queue.workOrders);
+    free(world.emitters);
 
     return 0;
 }
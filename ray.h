@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <pthread.h>
 #include "math.h"
 
 #define arrayCount(array) (sizeof(array) / sizeof(array[0]))
@@ -34,6 +35,23 @@ struct BitmapHeader
     u32 colorsUsed;
     u32 colorsImportant;
 };
+
+struct BigTiffHeader
+{
+    u16 byteOrder;
+    u16 version;
+    u16 offsetSize;
+    u16 reserved;
+    u64 firstIfdOffset;
+};
+
+struct BigTiffEntry
+{
+    u16 tag;
+    u16 type;
+    u64 count;
+    u64 value; //left justified when it fits, file offset otherwise
+};
 #pragma pack(pop)
 
 struct Image
@@ -43,6 +61,28 @@ struct Image
     u32* pixels;
 };
 
+struct PixelAccumulator
+{
+    v3 radiance;
+    u32 samplesCount;
+};
+
+//render-time framebuffer, every tile is one contiguous
+//tileWidth*tileHeight block, edge tiles are padded
+struct TiledImage
+{
+    u32 width;
+    u32 height;
+    u32 tileWidth;
+    u32 tileHeight;
+    u32 tileCountX;
+    u32 tileCountY;
+    u32* pixels;
+
+    //same layout as pixels, only allocated in time budget mode
+    PixelAccumulator* accumulators;
+};
+
 struct Material
 {
     f32 shininess;
@@ -74,6 +114,47 @@ struct World
 
     u32 spheresCount;
     Sphere* spheres;
+
+    //indices of spheres with emissive materials
+    u32 emittersCount;
+    u32* emitters;
+};
+
+enum OutputFormat
+{
+    OutputFormat_BMP,
+    OutputFormat_QOI,
+    OutputFormat_PNG,
+};
+
+//one independently compressed horizontal strip of a PNG, one row of tiles
+struct PngStrip
+{
+    u8* data; //whole IDAT chunk
+    u32 size;
+    u32 rawSize;
+    u32 adler; //of the filtered rows
+    u64 encodeNanoseconds;
+};
+
+struct PngStream
+{
+    const TiledImage* source;
+    Image* image;
+    u32 stripsCount; //in file order, top row of tiles first
+    PngStrip* strips;
+    volatile u64* tilesRetired; //per row of tiles
+};
+
+struct Camera
+{
+    v3 position;
+    v3 x;
+    v3 y;
+    v3 z;
+    v3 filmCenter;
+    f32 halfFilmWidth;
+    f32 halfFilmHeight;
 };
 
 struct randomSeries
@@ -81,15 +162,158 @@ struct randomSeries
     u32 state;
 };
 
+#define footprintGridSide 16
+
+//cube around the scene that footprints record in, cells per side above
+struct FootprintGrid
+{
+    v3 min;
+    f32 cellSize;
+};
+
+//primitives and materials the tile's paths touched, one bit per index
+//modulo 64 so aliasing can only over-invalidate. The cells are the grid
+//cells its path and shadow ray segments crossed, outside is set once one
+//of them leaves the grid.
+struct TileFootprint
+{
+    u64 primitives;
+    u64 materials;
+    u64 cells[footprintGridSide * footprintGridSide * footprintGridSide / 64];
+    u64 outside;
+};
+
+struct TileEvent
+{
+    u64 start;
+    u64 end;
+    u64 bounces;
+    u32 minX; //tile corner, out-of-core orders do not outlive the tile
+    u32 minY;
+    u32 passIndex;
+    u64 counters[3]; //cycles, instructions, cache misses
+};
+
+struct WorkerProfile
+{
+    u32 eventsCount;
+    u32 eventsCapacity;
+    TileEvent* events;
+
+    //perf_event_open group, leader first, -1 if unavailable
+    s32 counterFds[3];
+
+    //readTimestamp ticks spent in rayCast's intersection and shading phases
+    u64 intersectionTicks;
+    u64 shadingTicks;
+};
+
+//per-tile state threaded through rayCast
+struct TileState
+{
+    randomSeries series;
+    TileFootprint footprint;
+    u64 bouncesComputed;
+    u64 shadowRaysComputed;
+    WorkerProfile* profile; //null unless profiling
+    const FootprintGrid* grid; //null unless re-rendering incrementally
+};
+
+enum SceneEditType
+{
+    SceneEdit_Material,
+    SceneEdit_Plane,
+    SceneEdit_Sphere,
+};
+
+struct SceneEdit
+{
+    SceneEditType type;
+    u32 index;
+    Material material;
+    Plane plane;
+    Sphere sphere;
+};
+
+//one entry of the batch table, the camera looks at the origin
+struct BatchView
+{
+    v3 cameraPosition;
+    const char* outputPath; //without extension, outputFormat picks it
+};
+
+//one camera of a batch, written out as soon as its last tile retires
+struct View
+{
+    char outputName[256]; //without extension
+    Camera camera;
+    TiledImage framebuffer;
+    Image image;
+    PngStream png;
+    u32 tilesCount;
+    volatile u64 tilesRetired;
+    volatile bool drained; //retired after the queue drained, written between passes
+};
+
 struct WorkOrder
 {
     World* world;
-    Image image;
+    u32 viewIndex;
+    const Camera* camera;
+    TiledImage image;
     randomSeries series;
     u32 minX;
     u32 minY;
     u32 onePastXCount;
     u32 onePastYCount;
+
+    TileFootprint footprint;
+    bool upToDate; //reused from the previous frame, skipped by renderTile
+
+    //out-of-core only: the worker's tile buffer, rows bottom up, stride tileWidth
+    u32* tilePixels;
+
+    //cost-aware scheduling: pre-pass estimate, sub-tiles claimed and retired
+    u64 estimatedCost;
+    volatile u64 nextSubTile;
+    volatile u64 subTilesRetired;
+};
+
+//out-of-core frame: orders are made per tile from the prototype and every
+//finished tile goes straight to its fixed place in a tiled BigTIFF
+struct TiffStream
+{
+    s32 fd;
+    WorkOrder prototype; //world, camera and the tile layout, no pixels
+    u64 tileBytes;
+    u64 dataOffset;
+    u64 fileSize;
+    volatile bool writeFailed;
+};
+
+struct NumaNode
+{
+    volatile u64 nextWorkOrderIndex;
+    u32 firstWorkOrder;
+    u32 onePastLastWorkOrder;
+
+    u32 cpuCount;
+    u32* cpus;
+
+    //node-local replica of the scene, null if not replicated
+    World* world;
+
+    //the node's share of the running parallel job
+    volatile u64 nextJobIndex;
+    u32 onePastLastJobIndex;
+};
+
+//runs on the persistent workers, indexes are split between the nodes like
+//the tiles are
+struct ParallelJob
+{
+    void (*proc)(void* data, u32 index);
+    void* data;
 };
 
 struct WorkQueue
@@ -97,7 +321,62 @@ struct WorkQueue
     u32 workOrdersCount;
     WorkOrder* workOrders;
 
+    u32 nodesCount;
+    NumaNode* nodes;
+    bool numaAware;
+    pthread_barrier_t firstTouchBarrier;
+
+    //every pass renders all tiles with passSamplesCount rays per pixel
+    pthread_barrier_t passBarrier;
+    u32 passIndex;
+    u32 passSamplesCount;
+    u64 deadline; //CLOCK_MONOTONIC ns, 0 if none
+    u64 outputNanoseconds; //time budget: measured resolve, encode and write, kept clear of the deadline
+    Image* outputImage;
+    volatile bool finished;
+
+    //set between passes while the workers run it instead of tiles
+    ParallelJob* job;
+
+    //encodes PNG strips as rows of tiles retire, null if off
+    PngStream* pngStream;
+
+    //footprints record grid cells only when scene edits will read them
+    FootprintGrid* footprintGrid;
+
+    //batch mode only, null otherwise
+    View* views;
+
+    //out-of-core only, null otherwise, workOrders is null then
+    TiffStream* tiffStream;
+
+    //cost-aware scheduling, null if tiles are never split: orders above the
+    //threshold render as sub-tiles that idle workers can steal
+    WorkOrder** splitOrders;
+    volatile u64 splitOrdersCount;
+    u64 splitCostThreshold;
+
+    volatile u64 samplesComputed;
     volatile u64 bouncesComputed;
+    volatile u64 shadowRaysComputed;
     volatile u64 tilesRetiredCount;
-    volatile u64 nextWorkOrderIndex;
+};
+
+struct ThreadContext
+{
+    pthread_t handle;
+    WorkQueue* queue;
+    u32 nodeIndex;
+    u32 nodeWorkerIndex;
+    World* world;
+    WorkerProfile profile;
+
+    //out-of-core only: the order in flight and the worker's tile buffers
+    WorkOrder streamedOrder;
+    u32* tilePixels;
+    u8* tileBytes;
+
+    //this frame, for the tail idle report
+    u64 busyNanoseconds;
+    u64 lastRectEnd;
 };